@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "attempts.h"
+#include "util.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// key << 32 | failures << 24 | second of the last failure (low 24 bits)
+// 0 = free
+typedef atomic<uint64_t> attemptSlot;
+
+// lives in shared memory, changed by compare and swap only
+struct attemptsState {
+    attemptSlot ips[ATTEMPTS_SLOTS];
+    attemptSlot users[ATTEMPTS_SLOTS];
+};
+
+static_assert(atomic<uint64_t>::is_always_lock_free);
+
+static attemptsState *state = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// failures of a slot that have not decayed yet
+static int failures(uint64_t word, uint32_t now) {
+    int count = (word >> 24) & 0xff;
+    uint32_t elapsed = (now - (uint32_t)word) & 0xffffff;
+    return max(count - (int)(elapsed / ATTEMPTS_DECAY), 0);
+}
+
+// the slot of key (-1 = none) and a free one to take (-1 = none)
+static void probe(attemptSlot *table, uint32_t key, uint32_t now, int &found, uint64_t &foundWord, int &freeSlot,
+                  uint64_t &freeWord) {
+    found = -1;
+    freeSlot = -1;
+    for (int i = 0; i < ATTEMPTS_PROBE; i++) {
+        uint32_t slot = (firstSlot(key, ATTEMPTS_SLOTS) + i) & (ATTEMPTS_SLOTS - 1);
+        uint64_t word = table[slot].load(memory_order_acquire);
+        bool live = word != 0 && failures(word, now) > 0;
+        if (live && word >> 32 == key) {
+            found = slot;
+            foundWord = word;
+            return;
+        }
+        if (!live && freeSlot == -1) {
+            freeSlot = slot;
+            freeWord = word;
+        }
+    }
+}
+
+static int fail(bool users, uint32_t key) {
+    if (state == NULL || key == 0) {
+        return 0;
+    }
+    attemptSlot *table = users ? state->users : state->ips;
+    uint32_t now = time(NULL);
+    while (true) {
+        int found, freeSlot;
+        uint64_t foundWord = 0, freeWord = 0;
+        probe(table, key, now, found, foundWord, freeSlot, freeWord);
+
+        int slot = found != -1 ? found : freeSlot;
+        if (slot == -1) {
+            fprintf(stderr, "login attempts table full, failure not counted\n");
+            return 0;
+        }
+        uint64_t expected = found != -1 ? foundWord : freeWord;
+        int failed = min(found != -1 ? failures(foundWord, now) + 1 : 1, 255);
+        uint64_t word = (uint64_t)key << 32 | (uint64_t)failed << 24 | (now & 0xffffff);
+        // another process counted or took the slot meanwhile, look again
+        if (table[slot].compare_exchange_weak(expected, word, memory_order_acq_rel)) {
+            return failed;
+        }
+    }
+}
+
+static int count(bool users, uint32_t key) {
+    if (state == NULL || key == 0) {
+        return 0;
+    }
+    attemptSlot *table = users ? state->users : state->ips;
+    uint32_t now = time(NULL);
+    int found, freeSlot;
+    uint64_t foundWord = 0, freeWord = 0;
+    probe(table, key, now, found, foundWord, freeSlot, freeWord);
+    return found != -1 ? failures(foundWord, now) : 0;
+}
+
+static void clear(bool users, uint32_t key) {
+    if (state == NULL || key == 0) {
+        return;
+    }
+    attemptSlot *table = users ? state->users : state->ips;
+    uint32_t now = time(NULL);
+    while (true) {
+        int found, freeSlot;
+        uint64_t foundWord = 0, freeWord = 0;
+        probe(table, key, now, found, foundWord, freeSlot, freeWord);
+        if (found == -1 || table[found].compare_exchange_weak(foundWord, 0, memory_order_acq_rel)) {
+            return;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int attemptsInit() {
+    // zero filled, nothing counted
+    void *mem = mmap(NULL, sizeof(attemptsState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap login attempts");
+        return -1;
+    }
+    state = (attemptsState *)mem;
+    return 0;
+}
+
+int attemptsFailIP(const string &ip) {
+    return fail(false, ipKey(ip));
+}
+
+int attemptsFailUser(const string &user) {
+    return fail(true, userKey(user));
+}
+
+int attemptsUser(const string &user) {
+    return count(true, userKey(user));
+}
+
+void attemptsClearIP(const string &ip) {
+    clear(false, ipKey(ip));
+}
+
+void attemptsClearUser(const string &user) {
+    clear(true, userKey(user));
+}
@@ -0,0 +1,41 @@
+#ifndef ATTEMPTS_H
+#define ATTEMPTS_H
+
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define ATTEMPTS_SLOTS 65536 // power of two, per table
+#define ATTEMPTS_PROBE 16    // slots looked at per address/user
+// seconds after which one failed LOGIN is forgiven
+#define ATTEMPTS_DECAY 20
+// failures an address may have before it is banned (blacklist.h)
+#define ATTEMPTS_MAX_IP 3
+// failures a user may have, from any addresses, before LOGINs for it are
+// refused without asking the directory until enough of them decayed
+#define ATTEMPTS_MAX_USER 10
+
+// failed LOGINs per client address and per user, shared by every process of
+// the server (anonymous shared memory set up before the workers/children are
+// forked), so the limits hold across connections, workers and threads
+// a slot is one 64 bit word (key, failures, second of the last failure) that
+// is only ever changed by compare and swap, nobody takes a lock and a process
+// dying midway leaves nothing half written
+// failures decay, one every ATTEMPTS_DECAY seconds since the last one; a slot
+// whose failures all decayed is free for another key
+// users are kept by a 32 bit hash of their name, two users sharing it (and a
+// probe sequence) share their failures
+
+// -1 if the shared memory can't be set up, nothing is counted then
+int attemptsInit();
+
+// counts a failed LOGIN, returns the failures now on record
+int attemptsFailIP(const std::string &ip);
+int attemptsFailUser(const std::string &user);
+// failures on record right now
+int attemptsUser(const std::string &user);
+// after a successful LOGIN
+void attemptsClearIP(const std::string &ip);
+void attemptsClearUser(const std::string &user);
+
+#endif
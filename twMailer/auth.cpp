@@ -0,0 +1,173 @@
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "auth.h"
+#include "bindcache.h"
+#include "credstore.h"
+#include "diskpool.h"
+#include "ldappool.h"
+#include "util.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// LDAP
+
+// the first LOGIN that asks the directory opens the rest of the pool in the
+// background (epoll/uring, fork mode children connect on demand)
+static bool ldapPoolWarm = false;
+
+static void warmLdapPool() {
+    if (ldapPoolWarm || !diskPoolRunning()) {
+        return;
+    }
+    ldapPoolWarm = true;
+    // this LOGIN's own connection goes to the pool as well
+    for (int i = 1; i < ldapPoolSize && i < LDAP_POOL_MAX; i++) {
+        diskSubmit(DISK_LDAP, [] { ldapPoolAdd(); }, [] {});
+    }
+}
+
+// sends the bind and waits for the answer without blocking the loop, gives
+// up after --ldap-timeout (LDAP_TIMEOUT, the connection is closed then)
+static task<int> directoryBind(scheduler *sched, LDAP *ldapHandle, const char *dn, BerValue *credentials) {
+    int msgid;
+    int rc = ldapBindStart(ldapHandle, dn, credentials, &msgid);
+    int fd = ldapDescriptor(ldapHandle);
+    if (rc != LDAP_SUCCESS || fd == -1) {
+        co_return rc != LDAP_SUCCESS ? rc : LDAP_SERVER_DOWN;
+    }
+
+    int64_t deadline = nowMs() + (int64_t)ldapTimeout * 1000;
+    while (true) {
+        bool finished;
+        rc = ldapBindResult(ldapHandle, msgid, &finished);
+        if (finished) {
+            co_return rc;
+        }
+        int64_t left = deadline - nowMs();
+        if (left <= 0) {
+            fprintf(stderr, "LDAP bind timed out\n");
+            ldapBindAbandon(ldapHandle, msgid);
+            co_return LDAP_TIMEOUT;
+        }
+        co_await readable(sched, fd, (int)left);
+    }
+}
+
+class ldapAuth : public authenticator {
+public:
+    const char *name() override {
+        return "ldap";
+    }
+
+    task<int> verify(scheduler *sched, const string &user, const string &password) override {
+        int rc = 0; // return code
+
+        // bind credentials
+        char ldapBindUser[256];
+        char ldapBindPassword[256];
+
+        snprintf(ldapBindUser, sizeof(ldapBindUser), "uid=%s,ou=people,dc=technikum-wien,dc=at", user.c_str());
+        snprintf(ldapBindPassword, sizeof(ldapBindPassword), "%s", password.c_str());
+
+        BerValue bindCredentials;
+        bindCredentials.bv_val = (char *)ldapBindPassword;
+        bindCredentials.bv_len = strlen(ldapBindPassword);
+
+        cout << ldapBindUser << endl;
+
+        // a recent LOGIN with the same password is answered from the cache
+        bool reachable = false;
+        int cached = bindCacheLookup(user.c_str(), ldapBindPassword);
+        if (cached >= 0) {
+            reachable = true;
+            rc = cached ? LDAP_SUCCESS : LDAP_INVALID_CREDENTIALS;
+        } else {
+            // borrows a pooled connection and waits for the directory's reply
+            // the directory may have dropped an idle one meanwhile, so one retry
+            // with a new connection
+            warmLdapPool();
+            for (int attempt = 0; attempt < 2; attempt++) {
+                LDAP *ldapHandle = attempt == 0 ? ldapIdle() : NULL;
+                if (ldapHandle == NULL) {
+                    // connect + StartTLS block, the bind itself doesn't
+                    co_await blockingStep(sched, DISK_LDAP, [&] { ldapHandle = ldapConnect(); });
+                }
+                if (ldapHandle == NULL) {
+                    break;
+                }
+                rc = co_await directoryBind(sched, ldapHandle, ldapBindUser, &bindCredentials);
+                ldapGiveBack(ldapHandle, ldapBroken(rc));
+                if (!ldapBroken(rc)) {
+                    reachable = true;
+                    break;
+                }
+                if (rc == LDAP_TIMEOUT) {
+                    break; // slow, not gone, a new connection waits just as long
+                }
+            }
+
+            // only definite answers are remembered
+            if (reachable && (rc == LDAP_SUCCESS || rc == LDAP_INVALID_CREDENTIALS)) {
+                bindCacheStore(user.c_str(), ldapBindPassword, rc == LDAP_SUCCESS);
+            }
+        }
+
+        cout << rc << endl;
+
+        strcpy(ldapBindUser, "");
+        strcpy(ldapBindPassword, "");
+
+        if (!reachable) {
+            fprintf(stderr, "LDAP not reachable\n");
+            co_return AUTH_UNREACHABLE;
+        }
+        if (rc != LDAP_SUCCESS) {
+            fprintf(stderr, "LDAP bind error: %s\n", ldap_err2string(rc));
+            co_return AUTH_REJECTED;
+        }
+        co_return AUTH_OK;
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL
+
+class localAuth : public authenticator {
+public:
+    const char *name() override {
+        return "local";
+    }
+
+    // the hash rounds are meant to be slow (CRED_ITERATIONS), they run on the
+    // disk pool instead of the loop thread; nothing goes through the bind
+    // cache, a password changed with --add-credential counts as soon as the
+    // database is mapped again
+    task<int> verify(scheduler *sched, const string &user, const string &password) override {
+        int verified = -1;
+        co_await blockingStep(sched, DISK_CRED, [&] { verified = credStoreVerify(user, password); });
+        if (verified == -1) {
+            fprintf(stderr, "no credential database\n");
+            co_return AUTH_UNREACHABLE;
+        }
+        co_return verified ? AUTH_OK : AUTH_REJECTED;
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+authenticator *ldapAuthenticator() {
+    static ldapAuth backend;
+    return &backend;
+}
+
+authenticator *localAuthenticator() {
+    static localAuth backend;
+    return &backend;
+}
+
+authenticator *authBackend = ldapAuthenticator();
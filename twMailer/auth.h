@@ -0,0 +1,36 @@
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <string>
+
+#include "task.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+// what verify() found out
+#define AUTH_OK 0
+#define AUTH_REJECTED 1    // wrong user or password, counts as a failed attempt
+#define AUTH_UNREACHABLE 2 // no answer, not the client's fault
+
+// where LOGIN checks credentials (--auth), one backend per server:
+// - ldap:  simple bind as uid=<user>,ou=people,... against --ldap, answered
+//          from the bind cache when it can (bindcache.h, ldappool.h)
+// - local: the memory-mapped credential database (credstore.h), checked in
+//          the process itself without any network hop
+// attempts, bans and the rest of LOGIN don't depend on the backend
+class authenticator {
+public:
+    virtual ~authenticator() {}
+
+    virtual const char *name() = 0;
+    // sched: where the session's blocking steps and waits go (see task.h)
+    virtual task<int> verify(scheduler *sched, const std::string &user, const std::string &password) = 0;
+};
+
+// the backend chosen with --auth, the directory by default
+extern authenticator *authBackend;
+
+authenticator *ldapAuthenticator();
+authenticator *localAuthenticator();
+
+#endif
@@ -0,0 +1,225 @@
+#include <map>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "auth.h"
+#include "bindcache.h"
+#include "credstore.h"
+#include "ldappool.h"
+#include "test.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// MOCK DIRECTORY
+// stands in for ldappool.cpp (not linked), every connection is a pipe the
+// test writes to when the directory "answers"
+
+struct mockConnection {
+    int fds[2];
+    bool started = false;   // a bind went out
+    bool answered = false;  // its result arrived
+    int answer = LDAP_SUCCESS;
+    int startRc = LDAP_SUCCESS; // what sending the bind returns
+    bool abandoned = false;
+    bool givenBack = false;
+    bool brokenBack = false;
+};
+
+const char *ldapUri = "mock";
+int ldapPoolSize = 1;
+int ldapTimeout = 5;
+
+static mockConnection *idle = NULL; // ldapIdle() hands it out once
+static mockConnection *fresh = NULL; // ldapConnect() hands it out once
+
+static LDAP *handle(mockConnection *conn) {
+    return (LDAP *)conn;
+}
+
+static mockConnection *mock(LDAP *ldapHandle) {
+    return (mockConnection *)ldapHandle;
+}
+
+LDAP *ldapConnect() {
+    mockConnection *conn = fresh;
+    fresh = NULL;
+    return handle(conn);
+}
+
+void ldapPoolAdd() {}
+
+LDAP *ldapIdle() {
+    mockConnection *conn = idle;
+    idle = NULL;
+    return handle(conn);
+}
+
+void ldapGiveBack(LDAP *ldapHandle, bool broken) {
+    mock(ldapHandle)->givenBack = true;
+    mock(ldapHandle)->brokenBack = broken;
+}
+
+bool ldapBroken(int rc) {
+    return rc == LDAP_SERVER_DOWN || rc == LDAP_CONNECT_ERROR || rc == LDAP_TIMEOUT || rc == LDAP_LOCAL_ERROR;
+}
+
+int ldapBindStart(LDAP *ldapHandle, const char *, BerValue *, int *msgid) {
+    mock(ldapHandle)->started = true;
+    *msgid = 1;
+    return mock(ldapHandle)->startRc;
+}
+
+int ldapBindResult(LDAP *ldapHandle, int, bool *finished) {
+    *finished = mock(ldapHandle)->answered;
+    return *finished ? mock(ldapHandle)->answer : LDAP_SUCCESS;
+}
+
+void ldapBindAbandon(LDAP *ldapHandle, int) {
+    mock(ldapHandle)->abandoned = true;
+}
+
+int ldapDescriptor(LDAP *ldapHandle) {
+    return mock(ldapHandle)->fds[0];
+}
+
+static void mockInit(mockConnection &conn) {
+    CHECK(pipe(conn.fds) == 0);
+}
+
+static void mockAnswer(mockConnection &conn, int rc) {
+    conn.answer = rc;
+    conn.answered = true;
+    CHECK(write(conn.fds[1], "x", 1) == 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// an event loop that only remembers who waits for which descriptor, the test
+// resumes them
+class mockLoop : public scheduler {
+public:
+    map<int, std::coroutine_handle<>> waiting;
+
+    bool watches() override {
+        return true;
+    }
+
+    void waitReadable(int fd, int, std::coroutine_handle<> h) override {
+        CHECK(waiting.count(fd) == 0);
+        waiting[fd] = h;
+    }
+
+    void wake(int fd) {
+        CHECK(waiting.count(fd) == 1);
+        std::coroutine_handle<> h = waiting[fd];
+        waiting.erase(fd);
+        h.resume();
+    }
+};
+
+// runs verify() like a session does, *verdict stays -1 while it waits
+static detachedTask login(mockLoop *loop, const char *user, const char *password, int *verdict) {
+    *verdict = -1;
+    *verdict = co_await authBackend->verify(loop, user, password);
+}
+
+static void start(mockLoop &loop, const char *user, const char *password, int *verdict) {
+    login(&loop, user, password, verdict).handle.resume();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main() {
+    mockLoop loop;
+    int verdict;
+
+    // the bind goes out, LOGIN waits for the directory without blocking
+    mockConnection a;
+    mockInit(a);
+    idle = &a;
+    start(loop, "bob", "secret", &verdict);
+    CHECK(a.started && verdict == -1 && loop.waiting.count(a.fds[0]) == 1);
+    mockAnswer(a, LDAP_SUCCESS);
+    loop.wake(a.fds[0]);
+    CHECK(verdict == AUTH_OK && a.givenBack && !a.brokenBack);
+
+    // wrong password
+    mockConnection b;
+    mockInit(b);
+    idle = &b;
+    start(loop, "bob", "wrong", &verdict);
+    mockAnswer(b, LDAP_INVALID_CREDENTIALS);
+    loop.wake(b.fds[0]);
+    CHECK(verdict == AUTH_REJECTED && b.givenBack && !b.brokenBack);
+
+    // two LOGINs wait at once, answered in the other order
+    mockConnection c, d;
+    mockInit(c);
+    mockInit(d);
+    int first, second;
+    idle = &c;
+    start(loop, "bob", "secret", &first);
+    fresh = &d;
+    start(loop, "alice", "secret", &second);
+    CHECK(first == -1 && second == -1 && loop.waiting.size() == 2);
+    mockAnswer(d, LDAP_SUCCESS);
+    loop.wake(d.fds[0]);
+    CHECK(first == -1 && second == AUTH_OK);
+    mockAnswer(c, LDAP_INVALID_CREDENTIALS);
+    loop.wake(c.fds[0]);
+    CHECK(first == AUTH_REJECTED);
+
+    // a pooled connection the directory dropped: one retry on a new one
+    mockConnection dropped, e;
+    mockInit(dropped);
+    mockInit(e);
+    dropped.startRc = LDAP_SERVER_DOWN;
+    idle = &dropped;
+    fresh = &e;
+    start(loop, "bob", "secret", &verdict);
+    CHECK(dropped.givenBack && dropped.brokenBack && e.started);
+    mockAnswer(e, LDAP_SUCCESS);
+    loop.wake(e.fds[0]);
+    CHECK(verdict == AUTH_OK);
+
+    // no directory at all
+    start(loop, "bob", "secret", &verdict);
+    CHECK(verdict == AUTH_UNREACHABLE);
+
+    // no answer within --ldap-timeout: abandoned, no retry
+    mockConnection slow;
+    mockInit(slow);
+    idle = &slow;
+    ldapTimeout = 0;
+    start(loop, "bob", "secret", &verdict);
+    CHECK(verdict == AUTH_UNREACHABLE && slow.abandoned && slow.brokenBack && loop.waiting.empty());
+
+    // local backend: a changed password counts once the database is mapped
+    // again, nothing is answered from the bind cache
+    char dir[] = "/tmp/authtestXXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    CHECK(mkdir((string(dir) + "/bin").c_str(), 0777) == 0);
+    CHECK(chdir((string(dir) + "/bin").c_str()) == 0);
+    CHECK(bindCacheInit() == 0);
+    // only names SEND can address, nothing that leaves the mailbox directory
+    CHECK(credStoreSet("a/b", "x") == -1 && credStoreSet(".", "x") == -1 && credStoreSet("Carol", "x") == -1);
+    CHECK(credStoreSet("carolinex", "x") == -1);
+    CHECK(credStoreSet("carol", "old") == 0);
+    CHECK(credStoreOpen() == 0);
+    authBackend = localAuthenticator();
+    start(loop, "carol", "old", &verdict);
+    CHECK(verdict == AUTH_OK);
+    CHECK(credStoreSet("carol", "new") == 0);
+    sleep(1); // the database file is looked at once a second
+    start(loop, "carol", "old", &verdict);
+    CHECK(verdict == AUTH_REJECTED);
+    start(loop, "carol", "new", &verdict);
+    CHECK(verdict == AUTH_OK);
+    CHECK(system(("rm -rf " + string(dir)).c_str()) == 0);
+
+    return testResult("authtest");
+}
@@ -0,0 +1,162 @@
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <time.h>
+
+#include "bindcache.h"
+#include "sha256.h"
+#include "util.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define HASH_WORDS (SHA256_SIZE / 8)
+
+// lives in shared memory, so only lock-free atomics in here
+struct bindCacheSlot {
+    atomic<uint32_t> version; // odd while a writer is in the slot
+    atomic<uint64_t> user[HASH_WORDS];
+    atomic<uint64_t> proof[HASH_WORDS];
+    atomic<int64_t> expires;  // CLOCK_MONOTONIC ms, 0 = empty
+    atomic<int32_t> verified;
+};
+
+// other processes see the same memory, a lock inside std::atomic wouldn't be shared
+static_assert(atomic<uint32_t>::is_always_lock_free && atomic<uint64_t>::is_always_lock_free &&
+              atomic<int64_t>::is_always_lock_free && atomic<int32_t>::is_always_lock_free);
+
+int bindCacheTtl = BIND_CACHE_DEFAULT_TTL;
+
+static bindCacheSlot *slots = NULL;
+static unsigned char secret[32];
+
+///////////////////////////////////////////////////////////////////////////////
+
+// the terminating '\0' of user separates it from the password
+static void hashCredentials(const char *user, const char *password, uint64_t userHash[HASH_WORDS],
+                            uint64_t proofHash[HASH_WORDS]) {
+    sha256Context ctx;
+    sha256Init(ctx);
+    sha256Update(ctx, secret, sizeof(secret));
+    sha256Update(ctx, user, strlen(user) + 1);
+    sha256Context withPassword = ctx;
+    sha256Final(ctx, (unsigned char *)userHash);
+
+    sha256Update(withPassword, password, strlen(password));
+    sha256Final(withPassword, (unsigned char *)proofHash);
+}
+
+static bool sameUser(bindCacheSlot &slot, const uint64_t userHash[HASH_WORDS]) {
+    for (int i = 0; i < HASH_WORDS; i++) {
+        if (slot.user[i].load(memory_order_relaxed) != userHash[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int bindCacheInit() {
+    if (getrandom(secret, sizeof(secret), 0) != (ssize_t)sizeof(secret)) {
+        perror("getrandom");
+        return -1;
+    }
+
+    // zero filled, every slot starts empty
+    void *mem = mmap(NULL, BIND_CACHE_SLOTS * sizeof(bindCacheSlot), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap bind cache");
+        return -1;
+    }
+    slots = (bindCacheSlot *)mem;
+    return 0;
+}
+
+int bindCacheLookup(const char *user, const char *password) {
+    if (slots == NULL || bindCacheTtl <= 0) {
+        return -1;
+    }
+
+    uint64_t userHash[HASH_WORDS];
+    uint64_t proofHash[HASH_WORDS];
+    hashCredentials(user, password, userHash, proofHash);
+
+    int64_t now = nowMs();
+    for (unsigned i = 0; i < BIND_CACHE_PROBE; i++) {
+        bindCacheSlot &slot = slots[(userHash[0] + i) & (BIND_CACHE_SLOTS - 1)];
+
+        uint32_t before = slot.version.load(memory_order_acquire);
+        if (before & 1) {
+            continue; // being written
+        }
+        bool match = sameUser(slot, userHash);
+        bool proofMatch = true;
+        for (int j = 0; j < HASH_WORDS; j++) {
+            proofMatch = proofMatch && slot.proof[j].load(memory_order_relaxed) == proofHash[j];
+        }
+        int64_t expires = slot.expires.load(memory_order_relaxed);
+        int32_t verified = slot.verified.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (slot.version.load(memory_order_relaxed) != before) {
+            continue; // changed while reading
+        }
+
+        if (match && proofMatch && expires > now) {
+            return verified;
+        }
+    }
+    // another password than the cached ones has to be checked
+    return -1;
+}
+
+void bindCacheStore(const char *user, const char *password, bool verified) {
+    if (slots == NULL || bindCacheTtl <= 0) {
+        return;
+    }
+
+    uint64_t userHash[HASH_WORDS];
+    uint64_t proofHash[HASH_WORDS];
+    hashCredentials(user, password, userHash, proofHash);
+
+    // the user's slot for this kind of answer, else an empty or expired one,
+    // else the oldest; a wrong password never replaces the right one
+    int64_t now = nowMs();
+    bindCacheSlot *target = NULL;
+    int64_t oldest = INT64_MAX;
+    for (unsigned i = 0; i < BIND_CACHE_PROBE; i++) {
+        bindCacheSlot &slot = slots[(userHash[0] + i) & (BIND_CACHE_SLOTS - 1)];
+        int64_t expires = slot.expires.load(memory_order_relaxed);
+        if (sameUser(slot, userHash) && slot.verified.load(memory_order_relaxed) == (verified ? 1 : 0) &&
+            expires != 0) {
+            target = &slot;
+            break;
+        }
+        if (expires < oldest) {
+            oldest = expires;
+            target = &slot;
+        }
+    }
+
+    // claim the slot, someone else writing it wins
+    uint32_t version = target->version.load(memory_order_relaxed);
+    if ((version & 1) || !target->version.compare_exchange_strong(version, version + 1, memory_order_acquire)) {
+        return;
+    }
+    atomic_thread_fence(memory_order_release);
+
+    for (int i = 0; i < HASH_WORDS; i++) {
+        target->user[i].store(userHash[i], memory_order_relaxed);
+        target->proof[i].store(proofHash[i], memory_order_relaxed);
+    }
+    int64_t ttl = verified ? bindCacheTtl : BIND_CACHE_NEGATIVE_TTL;
+    target->expires.store(now + ttl * 1000, memory_order_relaxed);
+    target->verified.store(verified ? 1 : 0, memory_order_relaxed);
+
+    target->version.store(version + 2, memory_order_release);
+}
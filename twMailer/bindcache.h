@@ -0,0 +1,33 @@
+#ifndef BINDCACHE_H
+#define BINDCACHE_H
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define BIND_CACHE_SLOTS 8192 // power of two
+#define BIND_CACHE_PROBE 8    // slots looked at per user
+// seconds a verified password is trusted (--bind-cache-ttl, 0 = off)
+#define BIND_CACHE_DEFAULT_TTL 300
+// seconds a rejected password is answered without asking the directory
+#define BIND_CACHE_NEGATIVE_TTL 10
+
+// results of recent LDAP binds (auth.h), shared by every process of the
+// server
+// a user has at most one verified and one rejected password cached
+// (anonymous shared memory set up before the workers/children are forked)
+// only salted SHA-256 values are stored, never a password:
+//   user  = H(secret, uid)            finds the slot
+//   proof = H(secret, uid, password)  must match to answer from the cache
+// the secret is random per server start
+// a slot is guarded by a version counter (seqlock), readers never wait and
+// a process dying while writing loses that one slot, nothing is locked
+
+extern int bindCacheTtl;
+
+// -1 if the shared memory can't be set up, the cache is off then
+int bindCacheInit();
+// 1: verified, 0: rejected, -1: ask the directory
+int bindCacheLookup(const char *user, const char *password);
+// remember a definite answer of the directory
+void bindCacheStore(const char *user, const char *password, bool verified);
+
+#endif
@@ -0,0 +1,454 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <vector>
+
+#include "blacklist.h"
+#include "util.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// lives in shared memory, a slot is read without the lock
+struct blacklistState {
+    pthread_mutex_t lock;                    // process shared, for bans and the wheel
+    atomic<uint64_t> slots[BLACKLIST_SLOTS]; // address << 32 | expiry, 0 = free
+    uint32_t next[BLACKLIST_SLOTS];          // wheel list a used slot is in (index + 1)
+    uint32_t wheel[BLACKLIST_WHEEL];         // first slot of each list (index + 1), 0 = empty
+    int64_t wheelTime;                       // last second ticked
+    atomic<uint64_t> changes;                // bumped by every ban and expiry
+};
+
+static_assert(atomic<uint64_t>::is_always_lock_free);
+
+// an IPv6 address, IPv4 ones as ::ffff:a.b.c.d
+typedef unsigned __int128 rangeKey;
+
+// a trie node stands for the first len bits of key, the bits in between it
+// and its parent are the same for everything below (path compression)
+struct rangeNode {
+    rangeKey key;      // bits past len are 0
+    uint32_t child[2]; // by bit len of the address, index into networks, 0 = none
+    uint8_t len;
+    bool banned;       // the whole network, nothing below is looked at
+};
+
+int blacklistBanSeconds = BLACKLIST_DEFAULT_BAN;
+
+static blacklistState *state = NULL;
+static uint64_t savedChanges = 0; // what BLACKLIST_FILE holds, per process
+
+// built before any fork or thread and only read afterwards
+// networks[0] is the root (len 0), empty when no network is banned
+static vector<rangeNode> networks;
+// per IPv4 prefix of BLACKLIST_RANGES_STRIDE bits, the deepest node every
+// address with it passes through
+static vector<uint32_t> ipv4Start;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// host byte order, false for anything but a dotted IPv4 address (0.0.0.0 included)
+static bool parseAddress(const string &ip, uint32_t &addr) {
+    struct in_addr in;
+    if (inet_pton(AF_INET, ip.c_str(), &in) != 1 || in.s_addr == 0) {
+        return false;
+    }
+    addr = ntohl(in.s_addr);
+    return true;
+}
+
+static void lockState() {
+    if (pthread_mutex_lock(&state->lock) == EOWNERDEAD) {
+        // a process died holding it, a ban it was adding may be lost
+        pthread_mutex_consistent(&state->lock);
+    }
+}
+
+// with the lock held
+static void pushWheel(uint32_t slot, uint32_t expires) {
+    uint32_t &head = state->wheel[expires % BLACKLIST_WHEEL];
+    state->next[slot] = head;
+    head = slot + 1;
+}
+
+// with the lock held, an existing ban of addr is renewed, otherwise a free or
+// expired slot taken
+static void addBan(uint32_t addr, uint32_t expires, uint32_t now) {
+    uint64_t word = (uint64_t)addr << 32 | expires;
+    int freeSlot = -1;
+    for (int i = 0; i < BLACKLIST_PROBE; i++) {
+        uint32_t slot = (firstSlot(addr, BLACKLIST_SLOTS) + i) & (BLACKLIST_SLOTS - 1);
+        uint64_t current = state->slots[slot].load(memory_order_relaxed);
+        if (current >> 32 == addr) {
+            // already in the wheel, the tick files it anew
+            state->slots[slot].store(word, memory_order_release);
+            state->changes.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        if (freeSlot == -1 && (uint32_t)current <= now) {
+            freeSlot = slot;
+        }
+    }
+    if (freeSlot == -1) {
+        fprintf(stderr, "blacklist full, address not banned\n");
+        return;
+    }
+
+    // an expired ban of another address is still in the wheel
+    bool listed = state->slots[freeSlot].load(memory_order_relaxed) != 0;
+    state->slots[freeSlot].store(word, memory_order_release);
+    if (!listed) {
+        pushWheel(freeSlot, expires);
+    }
+    state->changes.fetch_add(1, memory_order_relaxed);
+}
+
+static void loadBans() {
+    FILE *file = fopen(BLACKLIST_FILE, "r");
+    if (file == NULL) {
+        if (errno != ENOENT) {
+            perror("open " BLACKLIST_FILE);
+        }
+        return;
+    }
+
+    uint32_t now = time(NULL);
+    char line[128];
+    int loaded = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char ip[64];
+        long long expires = 0;
+        int fields = sscanf(line, "%63s %lld", ip, &expires);
+        uint32_t addr;
+        if (fields < 1 || !parseAddress(ip, addr)) {
+            continue;
+        }
+        if (fields == 1) {
+            expires = now + blacklistBanSeconds;
+        }
+        if (expires > now) {
+            addBan(addr, expires, now);
+            loaded++;
+        }
+    }
+    fclose(file);
+    printf("Loaded %d banned addresses\n", loaded);
+    fflush(stdout); // before the fork, or every child prints it again
+}
+
+// written aside and renamed, a reader never sees half a file
+static void saveBans() {
+    FILE *file = fopen(BLACKLIST_FILE ".tmp", "w");
+    if (file == NULL) {
+        perror("open " BLACKLIST_FILE ".tmp");
+        return;
+    }
+    uint32_t now = time(NULL);
+    for (int i = 0; i < BLACKLIST_SLOTS; i++) {
+        uint64_t word = state->slots[i].load(memory_order_acquire);
+        if ((uint32_t)word <= now) {
+            continue;
+        }
+        struct in_addr in;
+        in.s_addr = htonl(word >> 32);
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &in, ip, sizeof(ip));
+        fprintf(file, "%s %u\n", ip, (uint32_t)word);
+    }
+    if (fclose(file) != 0 || rename(BLACKLIST_FILE ".tmp", BLACKLIST_FILE) == -1) {
+        perror("write " BLACKLIST_FILE);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RANGES
+
+static rangeKey prefixMask(int len) {
+    return len == 0 ? 0 : ~(rangeKey)0 << (128 - len);
+}
+
+// bit i, counted from the most significant one
+static int bitAt(rangeKey key, int i) {
+    return (int)(key >> (127 - i)) & 1;
+}
+
+// leading bits a and b have in common
+static int commonBits(rangeKey a, rangeKey b) {
+    rangeKey diff = a ^ b;
+    uint64_t high = (uint64_t)(diff >> 64);
+    uint64_t low = (uint64_t)diff;
+    if (high != 0) {
+        return __builtin_clzll(high);
+    }
+    return low != 0 ? 64 + __builtin_clzll(low) : 128;
+}
+
+static rangeKey mappedKey(uint32_t addr) {
+    return (rangeKey)0xffff << 32 | addr;
+}
+
+static rangeKey ipv6Key(const struct in6_addr &in6) {
+    rangeKey key = 0;
+    for (int i = 0; i < 16; i++) {
+        key = key << 8 | in6.s6_addr[i];
+    }
+    return key;
+}
+
+static uint32_t newRange(rangeKey key, int len, bool banned) {
+    networks.push_back(rangeNode{key, {0, 0}, (uint8_t)len, banned});
+    return networks.size() - 1;
+}
+
+static void addRange(rangeKey key, int len) {
+    key &= prefixMask(len);
+    uint32_t node = 0;
+    while (true) {
+        if (networks[node].banned) {
+            return; // inside a banned network already
+        }
+        if (networks[node].len == len) {
+            // what hangs below is inside now, unreachable from here on
+            networks[node].banned = true;
+            networks[node].child[0] = networks[node].child[1] = 0;
+            return;
+        }
+        int side = bitAt(key, networks[node].len);
+        uint32_t child = networks[node].child[side];
+        if (child == 0) {
+            uint32_t leaf = newRange(key, len, true);
+            networks[node].child[side] = leaf;
+            return;
+        }
+        int common = min(commonBits(key, networks[child].key), min(len, (int)networks[child].len));
+        if (common == networks[child].len) {
+            node = child;
+            continue;
+        }
+
+        // the network ends or branches off on the way to child
+        uint32_t split;
+        if (common == len) {
+            split = newRange(key, len, true);
+        } else {
+            split = newRange(key & prefixMask(common), common, false);
+            uint32_t leaf = newRange(key, len, true);
+            networks[split].child[bitAt(networks[child].key, common)] = child;
+            networks[split].child[bitAt(key, common)] = leaf;
+        }
+        networks[node].child[side] = split;
+        return;
+    }
+}
+
+// start: a node on the way to key, 0 (the root) if unknown
+static bool rangeBanned(rangeKey key, uint32_t start) {
+    uint32_t node = start;
+    while (true) {
+        const rangeNode &range = networks[node];
+        if ((key & prefixMask(range.len)) != range.key) {
+            return false;
+        }
+        if (range.banned) {
+            return true;
+        }
+        node = range.len < 128 ? range.child[bitAt(key, range.len)] : 0;
+        if (node == 0) {
+            return false;
+        }
+    }
+}
+
+static void indexIPv4() {
+    int len = 96 + BLACKLIST_RANGES_STRIDE;
+    ipv4Start.assign(1 << BLACKLIST_RANGES_STRIDE, 0);
+    for (uint32_t prefix = 0; prefix < ipv4Start.size(); prefix++) {
+        rangeKey key = mappedKey(prefix << (32 - BLACKLIST_RANGES_STRIDE));
+        uint32_t node = 0;
+        while (!networks[node].banned && networks[node].len < len) {
+            // deeper nodes, or ones off the way, depend on the other bits
+            uint32_t child = networks[node].child[bitAt(key, networks[node].len)];
+            if (child == 0 || networks[child].len > len ||
+                (key & prefixMask(networks[child].len)) != networks[child].key) {
+                break;
+            }
+            node = child;
+        }
+        ipv4Start[prefix] = node;
+    }
+}
+
+// "<network>/<prefix>" or a single address
+static bool parseRange(const char *line, rangeKey &key, int &len) {
+    char ip[INET6_ADDRSTRLEN];
+    int prefix = -1;
+    if (sscanf(line, " %45[^/ \t\n]/%d", ip, &prefix) < 1) {
+        return false;
+    }
+    struct in_addr in;
+    struct in6_addr in6;
+    if (inet_pton(AF_INET, ip, &in) == 1) {
+        key = mappedKey(ntohl(in.s_addr));
+        len = prefix == -1 ? 32 : prefix;
+        if (len < 0 || len > 32) {
+            return false;
+        }
+        len += 96;
+        return true;
+    }
+    if (inet_pton(AF_INET6, ip, &in6) == 1) {
+        key = ipv6Key(in6);
+        len = prefix == -1 ? 128 : prefix;
+        return len >= 0 && len <= 128;
+    }
+    return false;
+}
+
+static void loadRanges() {
+    FILE *file = fopen(BLACKLIST_RANGES_FILE, "r");
+    if (file == NULL) {
+        if (errno != ENOENT) {
+            perror("open " BLACKLIST_RANGES_FILE);
+        }
+        return;
+    }
+
+    newRange(0, 0, false);
+    char line[128];
+    int number = 0;
+    int loaded = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        number++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        if (line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+        rangeKey key;
+        int len;
+        if (!parseRange(line, key, len)) {
+            fprintf(stderr, "%s:%d: not a network\n", BLACKLIST_RANGES_FILE, number);
+            continue;
+        }
+        addRange(key, len);
+        loaded++;
+    }
+    fclose(file);
+    networks.shrink_to_fit();
+    indexIPv4();
+    printf("Loaded %d banned networks\n", loaded);
+    fflush(stdout); // before the fork, or every child prints it again
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int blacklistInit() {
+    // no shared memory, read once per process
+    loadRanges();
+
+    // zero filled, no bans, empty wheel
+    void *mem = mmap(NULL, sizeof(blacklistState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap blacklist");
+        return -1;
+    }
+    state = (blacklistState *)mem;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&state->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    state->wheelTime = time(NULL);
+    // what was loaded is written back on the first tick, with expiries
+    loadBans();
+    return 0;
+}
+
+bool blacklistRange(const struct sockaddr *address) {
+    if (networks.empty()) {
+        return false;
+    }
+    if (address->sa_family == AF_INET) {
+        uint32_t addr = ntohl(((const struct sockaddr_in *)address)->sin_addr.s_addr);
+        return rangeBanned(mappedKey(addr), ipv4Start[addr >> (32 - BLACKLIST_RANGES_STRIDE)]);
+    }
+    if (address->sa_family == AF_INET6) {
+        return rangeBanned(ipv6Key(((const struct sockaddr_in6 *)address)->sin6_addr), 0);
+    }
+    return false;
+}
+
+bool blacklistCheck(const string &ip) {
+    uint32_t addr;
+    if (state == NULL || !parseAddress(ip, addr)) {
+        return false;
+    }
+    uint32_t now = time(NULL);
+    for (int i = 0; i < BLACKLIST_PROBE; i++) {
+        uint32_t slot = (firstSlot(addr, BLACKLIST_SLOTS) + i) & (BLACKLIST_SLOTS - 1);
+        uint64_t word = state->slots[slot].load(memory_order_acquire);
+        if (word >> 32 == addr && (uint32_t)word > now) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void blacklistBan(const string &ip) {
+    uint32_t addr;
+    if (state == NULL || !parseAddress(ip, addr)) {
+        return;
+    }
+    uint32_t now = time(NULL);
+    lockState();
+    addBan(addr, now + blacklistBanSeconds, now);
+    pthread_mutex_unlock(&state->lock);
+}
+
+void blacklistTick() {
+    if (state == NULL) {
+        return;
+    }
+    int64_t now = time(NULL);
+
+    lockState();
+    // every wheel slot once at most, however long the last tick is ago
+    int64_t second = max(state->wheelTime + 1, now - BLACKLIST_WHEEL + 1);
+    for (; second <= now; second++) {
+        uint32_t list = state->wheel[second % BLACKLIST_WHEEL];
+        state->wheel[second % BLACKLIST_WHEEL] = 0;
+        while (list != 0) {
+            uint32_t slot = list - 1;
+            list = state->next[slot];
+            uint64_t word = state->slots[slot].load(memory_order_relaxed);
+            if ((uint32_t)word <= now) {
+                state->slots[slot].store(0, memory_order_release);
+                state->changes.fetch_add(1, memory_order_relaxed);
+            } else {
+                // renewed, or due in a later round of the wheel
+                pushWheel(slot, (uint32_t)word);
+            }
+        }
+    }
+    state->wheelTime = now;
+    pthread_mutex_unlock(&state->lock);
+
+    uint64_t changes = state->changes.load(memory_order_relaxed);
+    if (changes != savedChanges) {
+        saveBans();
+        savedChanges = changes;
+    }
+}
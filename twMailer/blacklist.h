@@ -0,0 +1,56 @@
+#ifndef BLACKLIST_H
+#define BLACKLIST_H
+
+#include <string>
+#include <sys/socket.h>
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define BLACKLIST_FILE "../blacklist.txt"
+// seconds an address stays banned after 3 failed LOGINs (--ban-seconds)
+#define BLACKLIST_DEFAULT_BAN 60
+#define BLACKLIST_SLOTS 65536 // power of two
+#define BLACKLIST_PROBE 16    // slots looked at per address
+#define BLACKLIST_WHEEL 64    // one second per wheel slot
+#define BLACKLIST_RANGES_FILE "../blacklist-ranges.txt"
+#define BLACKLIST_RANGES_STRIDE 16 // leading IPv4 bits resolved by a table
+
+// banned IPv4 addresses, shared by every process of the server (anonymous
+// shared memory set up before the workers/children are forked)
+// a slot is one 64 bit word (address, expiry), so LOGIN checks an address
+// with a few atomic loads and no lock; a ban that expired is no ban anymore
+// bans are added under a process shared (robust) mutex and also hang in a
+// timing wheel by their expiry, the housekeeping process ticks it every
+// second and frees the slots of expired bans; a ban that was renewed meanwhile
+// moves on to the wheel slot of its new expiry
+// BLACKLIST_FILE holds "<address> <expiry>" lines (seconds since the epoch),
+// it is read at startup and rewritten by the housekeeping process when bans
+// changed, never on the way of a LOGIN; a line without expiry (older
+// versions) bans the address for one period from startup
+
+// banned networks, kept by hand: BLACKLIST_RANGES_FILE holds one
+// "<network>/<prefix>" (or a single address) per line, IPv4 or IPv6, '#'
+// starts a comment; the server never writes it
+// it is read at startup into a path compressed binary trie (IPv4 as
+// ::ffff:a.b.c.d), so a lookup walks 128 bits at most however many networks
+// there are; an IPv4 lookup starts at the node a table gives for its leading
+// BLACKLIST_RANGES_STRIDE bits, and only the few levels below that are cache
+// misses with hundreds of thousands of networks; connections from them are
+// closed right after accept, before a session, a child or a directory
+// connection exists for them
+
+extern int blacklistBanSeconds;
+
+// -1 if the shared memory can't be set up, nobody is banned then (but the
+// networks of BLACKLIST_RANGES_FILE)
+int blacklistInit();
+// true if address (IPv4 or IPv6) is in a banned network
+bool blacklistRange(const struct sockaddr *address);
+// true while ip is banned
+bool blacklistCheck(const std::string &ip);
+// bans ip for blacklistBanSeconds from now
+void blacklistBan(const std::string &ip);
+// housekeeping, once a second: expired bans go, changes are written
+void blacklistTick();
+
+#endif
@@ -0,0 +1,125 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "blacklist.h"
+#include "test.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static bool banned(const char *ip) {
+    struct sockaddr_in in = {};
+    struct sockaddr_in6 in6 = {};
+    if (inet_pton(AF_INET, ip, &in.sin_addr) == 1) {
+        in.sin_family = AF_INET;
+        return blacklistRange((struct sockaddr *)&in);
+    }
+    CHECK(inet_pton(AF_INET6, ip, &in6.sin6_addr) == 1);
+    in6.sin6_family = AF_INET6;
+    return blacklistRange((struct sockaddr *)&in6);
+}
+
+static bool banned(uint32_t addr) {
+    struct sockaddr_in in = {};
+    in.sin_family = AF_INET;
+    in.sin_addr.s_addr = htonl(addr);
+    return blacklistRange((struct sockaddr *)&in);
+}
+
+static string dotted(uint32_t addr) {
+    struct in_addr in;
+    in.s_addr = htonl(addr);
+    return inet_ntoa(in);
+}
+
+// random IPv4 networks, compared with looking at every one of them
+struct network {
+    uint32_t addr;
+    int len;
+};
+
+static uint32_t mask(int len) {
+    return len == 0 ? 0 : ~0u << (32 - len);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main() {
+    // BLACKLIST_RANGES_FILE is relative to the working directory
+    char dir[] = "/tmp/blacklisttestXXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    CHECK(mkdir((string(dir) + "/bin").c_str(), 0777) == 0);
+    CHECK(chdir((string(dir) + "/bin").c_str()) == 0);
+
+    string ranges = "# comment\n"
+                    "10.0.0.0/8\n"
+                    "192.168.1.0/24\n"
+                    "192.168.1.128/25  # inside the one above\n"
+                    "172.16.5.4\n"
+                    "100.64.0.0/10\n"
+                    "44.16.0.0/12\n"
+                    "203.0.113.0/24\n"
+                    "203.0.112.0/24\n"
+                    "198.51.100.77/33\n"
+                    "not a network\n"
+                    "2001:db8::/32\n"
+                    "2001:db8:1::/48\n"
+                    "fe80::1\n";
+    srandom(1);
+    vector<network> networks;
+    for (int i = 0; i < 2000; i++) {
+        // clustered in 77.0.0.0/8, so prefixes share trie nodes
+        network n = {77u << 24 | ((uint32_t)random() & 0xffffff), 20 + (int)(random() % 13)};
+        n.addr &= mask(n.len);
+        networks.push_back(n);
+        ranges += dotted(n.addr) + "/" + to_string(n.len) + "\n";
+    }
+    FILE *file = fopen(BLACKLIST_RANGES_FILE, "w");
+    CHECK(file != NULL && fputs(ranges.c_str(), file) >= 0 && fclose(file) == 0);
+
+    CHECK(blacklistInit() == 0);
+
+    // prefixes and their edges
+    CHECK(banned("10.0.0.0") && banned("10.255.255.255") && banned("10.1.2.3"));
+    CHECK(!banned("9.255.255.255") && !banned("11.0.0.0"));
+    CHECK(banned("192.168.1.5") && banned("192.168.1.200") && !banned("192.168.2.1") && !banned("192.168.0.255"));
+    CHECK(banned("172.16.5.4") && !banned("172.16.5.5") && !banned("172.16.5.3"));
+    CHECK(banned("100.64.0.0") && banned("100.127.255.255") && !banned("100.128.0.0") && !banned("100.63.255.255"));
+    // shorter than the IPv4 start table's stride
+    CHECK(banned("44.16.0.1") && banned("44.31.255.255") && !banned("44.32.0.0") && !banned("44.15.255.255"));
+    // siblings that split one node
+    CHECK(banned("203.0.113.7") && banned("203.0.112.9") && !banned("203.0.114.1") && !banned("203.0.111.255"));
+    // lines that are not networks are skipped
+    CHECK(!banned("198.51.100.77"));
+
+    // IPv6, IPv4 mapped addresses are looked up as IPv4
+    CHECK(banned("2001:db8::1") && banned("2001:db8:ffff::1") && banned("2001:db8:1::5"));
+    CHECK(!banned("2001:db9::1") && !banned("2001:db7:ffff::1"));
+    CHECK(banned("fe80::1") && !banned("fe80::2"));
+    CHECK(banned("::ffff:10.9.9.9") && !banned("::ffff:11.9.9.9"));
+    CHECK(!banned("::1"));
+
+    for (int i = 0; i < 200000; i++) {
+        uint32_t addr = 77u << 24 | ((uint32_t)random() & 0xffffff);
+        if (i % 2 == 0) {
+            // somewhere in one of the networks
+            const network &n = networks[random() % networks.size()];
+            addr = n.addr | ((uint32_t)random() & ~mask(n.len));
+        }
+        bool expected = false;
+        for (size_t j = 0; j < networks.size() && !expected; j++) {
+            expected = (addr & mask(networks[j].len)) == networks[j].addr;
+        }
+        CHECK(banned(addr) == expected);
+    }
+
+    CHECK(system(("rm -rf " + string(dir)).c_str()) == 0);
+    return testResult("blacklisttest");
+}
@@ -0,0 +1,251 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "credstore.h"
+#include "sha256.h"
+#include "util.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define CRED_MAGIC "TWCRED1\n"
+#define CRED_SALT_SIZE 16
+
+struct credHeader {
+    char magic[8];
+    uint32_t slots; // power of two
+    uint32_t count; // used slots
+    uint32_t iterations;
+    char reserved[44];
+};
+
+struct credSlot {
+    char user[CRED_USER_MAX + 1]; // '\0' padded, empty = free
+    unsigned char salt[CRED_SALT_SIZE];
+    unsigned char hash[SHA256_SIZE];
+};
+
+static_assert(sizeof(credHeader) == 64 && sizeof(credSlot) == 64);
+static_assert(USER_NAME_MAX <= CRED_USER_MAX);
+
+// one mapping of CRED_FILE, unmapped once the last check using it is done
+struct credMapping {
+    void *mem;
+    size_t size;
+    ino_t ino;
+
+    credMapping(void *mem, size_t size, ino_t ino) : mem(mem), size(size), ino(ino) {}
+    credMapping(const credMapping &) = delete;
+    ~credMapping() { munmap(mem, size); }
+};
+
+static mutex mappingLock; // current and lastCheck, checks run on the disk pool
+static shared_ptr<credMapping> current;
+static time_t lastCheck = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// SHA-256(salt, password), then iterations - 1 times SHA-256(previous, salt)
+static void hashPassword(const unsigned char salt[CRED_SALT_SIZE], const string &password, uint32_t iterations,
+                         unsigned char digest[SHA256_SIZE]) {
+    sha256Context ctx;
+    sha256Init(ctx);
+    sha256Update(ctx, salt, CRED_SALT_SIZE);
+    sha256Update(ctx, password.data(), password.size());
+    sha256Final(ctx, digest);
+    for (uint32_t i = 1; i < iterations; i++) {
+        sha256Init(ctx);
+        sha256Update(ctx, digest, SHA256_SIZE);
+        sha256Update(ctx, salt, CRED_SALT_SIZE);
+        sha256Final(ctx, digest);
+    }
+}
+
+// slot of user, or the free slot where it would go
+static uint32_t findSlot(const credSlot *table, uint32_t slots, const string &user) {
+    uint32_t slot = stringHash(user) & (slots - 1);
+    while (table[slot].user[0] != '\0' && strncmp(table[slot].user, user.c_str(), sizeof(table[slot].user)) != 0) {
+        slot = (slot + 1) & (slots - 1);
+    }
+    return slot;
+}
+
+// NULL if the file is missing or not a database
+static void *mapDatabase(size_t &size, ino_t &ino) {
+    int fd = open(CRED_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            perror("open " CRED_FILE);
+        }
+        return NULL;
+    }
+    struct stat st;
+    void *mem = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(credHeader)) {
+        mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "%s: not a credential database\n", CRED_FILE);
+        return NULL;
+    }
+
+    const credHeader *header = (const credHeader *)mem;
+    uint32_t slots = header->slots;
+    if (memcmp(header->magic, CRED_MAGIC, sizeof(header->magic)) != 0 || slots == 0 || (slots & (slots - 1)) != 0 ||
+        header->count >= slots || header->iterations == 0 ||
+        (size_t)st.st_size != sizeof(credHeader) + (size_t)slots * sizeof(credSlot)) {
+        fprintf(stderr, "%s: not a credential database\n", CRED_FILE);
+        munmap(mem, st.st_size);
+        return NULL;
+    }
+    size = st.st_size;
+    ino = st.st_ino;
+    return mem;
+}
+
+// once a second at most, a replaced file is mapped anew
+// with mappingLock held
+static void reloadIfReplaced() {
+    time_t now = time(NULL);
+    if (now == lastCheck) {
+        return;
+    }
+    lastCheck = now;
+
+    struct stat st;
+    if (stat(CRED_FILE, &st) == -1 || (current && st.st_ino == current->ino)) {
+        return; // gone meanwhile: keep what we have
+    }
+    size_t size;
+    ino_t ino;
+    void *mem = mapDatabase(size, ino);
+    if (mem != NULL) {
+        current = make_shared<credMapping>(mem, size, ino);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int credStoreOpen() {
+    lock_guard<mutex> guard(mappingLock);
+    lastCheck = 0;
+    reloadIfReplaced();
+    if (!current) {
+        return -1;
+    }
+    printf("Credential database: %u users\n", ((const credHeader *)current->mem)->count);
+    fflush(stdout); // before the fork, or every child prints it again
+    return 0;
+}
+
+int credStoreVerify(const string &user, const string &password) {
+    shared_ptr<credMapping> mapping;
+    {
+        lock_guard<mutex> guard(mappingLock);
+        reloadIfReplaced();
+        mapping = current;
+    }
+    if (!mapping) {
+        return -1;
+    }
+    const credHeader *header = (const credHeader *)mapping->mem;
+    const credSlot *table = (const credSlot *)(header + 1);
+
+    // unknown users take as long as known ones
+    static const credSlot nobody = {};
+    const credSlot *slot = &nobody;
+    if (!user.empty() && user.size() <= CRED_USER_MAX) {
+        const credSlot *found = &table[findSlot(table, header->slots, user)];
+        if (found->user[0] != '\0') {
+            slot = found;
+        }
+    }
+
+    unsigned char digest[SHA256_SIZE];
+    hashPassword(slot->salt, password, header->iterations, digest);
+    unsigned char diff = 0;
+    for (int i = 0; i < SHA256_SIZE; i++) {
+        diff |= digest[i] ^ slot->hash[i];
+    }
+    return diff == 0 && slot != &nobody ? 1 : 0;
+}
+
+int credStoreSet(const string &user, const string &password) {
+    if (!validUser(user)) {
+        fprintf(stderr, "user names have 1 to %d of a-z, 0-9\n", USER_NAME_MAX);
+        return -1;
+    }
+
+    // everybody else is carried over
+    vector<credSlot> entries;
+    size_t size;
+    ino_t ino;
+    void *old = mapDatabase(size, ino);
+    uint32_t iterations = CRED_ITERATIONS;
+    if (old != NULL) {
+        const credHeader *header = (const credHeader *)old;
+        const credSlot *table = (const credSlot *)(header + 1);
+        iterations = header->iterations;
+        for (uint32_t i = 0; i < header->slots; i++) {
+            if (table[i].user[0] != '\0' && strncmp(table[i].user, user.c_str(), sizeof(table[i].user)) != 0) {
+                entries.push_back(table[i]);
+            }
+        }
+        munmap(old, size);
+    }
+
+    credSlot entry = {};
+    memcpy(entry.user, user.data(), user.size());
+    if (getrandom(entry.salt, sizeof(entry.salt), 0) != (ssize_t)sizeof(entry.salt)) {
+        perror("getrandom");
+        return -1;
+    }
+    hashPassword(entry.salt, password, iterations, entry.hash);
+    entries.push_back(entry);
+
+    // at most half full, probes stay short
+    uint32_t slots = CRED_MIN_SLOTS;
+    while (slots < entries.size() * 2) {
+        slots *= 2;
+    }
+    vector<credSlot> table(slots);
+    for (size_t i = 0; i < entries.size(); i++) {
+        table[findSlot(table.data(), slots, string(entries[i].user, strnlen(entries[i].user, CRED_USER_MAX)))] =
+            entries[i];
+    }
+    credHeader header = {};
+    memcpy(header.magic, CRED_MAGIC, sizeof(header.magic));
+    header.slots = slots;
+    header.count = entries.size();
+    header.iterations = iterations;
+
+    // written aside and renamed, a server never maps half a file
+    int fd = open(CRED_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror("open " CRED_FILE ".tmp");
+        return -1;
+    }
+    size_t tableSize = (size_t)slots * sizeof(credSlot);
+    bool written = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+                   write(fd, table.data(), tableSize) == (ssize_t)tableSize && fsync(fd) == 0;
+    if (close(fd) == -1 || !written || rename(CRED_FILE ".tmp", CRED_FILE) == -1) {
+        perror("write " CRED_FILE);
+        unlink(CRED_FILE ".tmp");
+        return -1;
+    }
+    printf("%s: %s set, %u users\n", CRED_FILE, user.c_str(), header.count);
+    return 0;
+}
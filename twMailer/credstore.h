@@ -0,0 +1,30 @@
+#ifndef CREDSTORE_H
+#define CREDSTORE_H
+
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define CRED_FILE "../credentials.db"
+#define CRED_USER_MAX 15     // longer names can't be stored
+#define CRED_ITERATIONS 1000 // SHA-256 rounds per password, fixed per database
+#define CRED_MIN_SLOTS 64    // power of two
+
+// local credential database for --auth local (service accounts, offline
+// load tests): a 64 byte header and an open-addressed table of 64 byte slots
+// (user, 16 byte random salt, iterated salted SHA-256 of the password), at
+// most half full
+// the server maps it read-only before forking, so checking a LOGIN is a hash
+// lookup plus the rounds, in the process and without any network hop
+// --add-credential writes a new file aside and renames it; the processes
+// notice the new inode within a second and map that one instead, checks
+// still running on the disk pool keep the old mapping until they are done
+
+// -1 if the database is missing or damaged
+int credStoreOpen();
+// 1: verified, 0: rejected (unknown users too), -1: no database
+int credStoreVerify(const std::string &user, const std::string &password);
+// adds user or changes its password, -1 on error
+int credStoreSet(const std::string &user, const std::string &password);
+
+#endif
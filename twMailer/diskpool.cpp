@@ -0,0 +1,199 @@
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <mutex>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "diskpool.h"
+#include "util.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct diskJob {
+    int op;
+    function<void()> work;
+    function<void()> done;
+    int64_t submitted; // us
+};
+
+// since the last report, except depth
+struct diskStats {
+    uint64_t jobs = 0;
+    int depth = 0; // queued or running right now
+    int maxDepth = 0;
+    int64_t waitUs = 0; // queued, summed up
+    int64_t maxWaitUs = 0;
+    int64_t runUs = 0;  // running, summed up
+    int64_t maxRunUs = 0;
+};
+
+static const char *opNames[DISK_OPS] = {"LDAP", "SEND", "LIST", "READ", "DEL", "CRED"};
+
+int diskThreads = DISK_DEFAULT_THREADS;
+int diskStatsInterval = 0;
+
+static mutex poolLock; // everything below except threads and eventFd
+static condition_variable wakeup;
+static deque<diskJob> queue;
+static vector<diskJob> finished;
+static diskStats stats[DISK_OPS];
+static bool stopping = false;
+static int64_t lastReport = 0;
+
+static vector<thread> threads;
+static int eventFd = -1;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void worker() {
+    unique_lock<mutex> guard(poolLock);
+    while (true) {
+        wakeup.wait(guard, [] { return stopping || !queue.empty(); });
+        if (stopping) {
+            return;
+        }
+        diskJob job = std::move(queue.front());
+        queue.pop_front();
+
+        int64_t started = nowUs();
+        diskStats &opStats = stats[job.op];
+        opStats.waitUs += started - job.submitted;
+        opStats.maxWaitUs = max(opStats.maxWaitUs, started - job.submitted);
+        guard.unlock();
+
+        job.work();
+
+        int64_t running = nowUs() - started;
+        guard.lock();
+        opStats.jobs++;
+        opStats.depth--;
+        opStats.runUs += running;
+        opStats.maxRunUs = max(opStats.maxRunUs, running);
+        finished.push_back(std::move(job));
+
+        // the loop may be asleep in epoll_wait()/io_uring_enter()
+        uint64_t one = 1;
+        if (write(eventFd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            perror("write eventfd");
+        }
+    }
+}
+
+// called with poolLock held
+static void report() {
+    for (int op = 0; op < DISK_OPS; op++) {
+        diskStats &opStats = stats[op];
+        if (opStats.jobs == 0 && opStats.depth == 0) {
+            continue;
+        }
+        uint64_t jobs = max(opStats.jobs, (uint64_t)1);
+        printf("Disk %-5s %llu jobs, queue %d (max %d), queued avg %lldus max %lldus, running avg %lldus max %lldus\n",
+               opNames[op], (unsigned long long)opStats.jobs, opStats.depth, opStats.maxDepth,
+               (long long)(opStats.waitUs / jobs), (long long)opStats.maxWaitUs, (long long)(opStats.runUs / jobs),
+               (long long)opStats.maxRunUs);
+
+        int depth = opStats.depth;
+        opStats = diskStats();
+        opStats.depth = depth;
+        opStats.maxDepth = depth;
+    }
+    fflush(stdout);
+    lastReport = nowUs();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int diskPoolStart() {
+    if (diskThreads <= 0) {
+        return -1;
+    }
+    eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+
+    // signals stay with the loop thread, a SIGINT must interrupt its wait
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 0; i < diskThreads; i++) {
+        threads.emplace_back(worker);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    lastReport = nowUs();
+    return eventFd;
+}
+
+void diskPoolStop() {
+    if (eventFd == -1) {
+        return;
+    }
+    {
+        lock_guard<mutex> guard(poolLock);
+        stopping = true;
+        for (size_t i = 0; i < queue.size(); i++) {
+            stats[queue[i].op].depth--;
+        }
+        queue.clear();
+    }
+    wakeup.notify_all();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    threads.clear();
+
+    lock_guard<mutex> guard(poolLock);
+    finished.clear();
+    if (diskStatsInterval > 0) {
+        report();
+    }
+    stopping = false;
+    close(eventFd);
+    eventFd = -1;
+}
+
+bool diskPoolRunning() {
+    return eventFd != -1;
+}
+
+void diskSubmit(int op, function<void()> work, function<void()> done) {
+    {
+        lock_guard<mutex> guard(poolLock);
+        diskStats &opStats = stats[op];
+        opStats.depth++;
+        opStats.maxDepth = max(opStats.maxDepth, opStats.depth);
+        queue.push_back(diskJob{op, std::move(work), std::move(done), nowUs()});
+    }
+    wakeup.notify_one();
+}
+
+void diskComplete() {
+    uint64_t count;
+    if (read(eventFd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read eventfd");
+    }
+
+    vector<diskJob> jobs;
+    {
+        lock_guard<mutex> guard(poolLock);
+        jobs.swap(finished);
+        if (diskStatsInterval > 0 && nowUs() - lastReport >= (int64_t)diskStatsInterval * 1000000) {
+            report();
+        }
+    }
+    // a completion may submit the session's next step
+    for (size_t i = 0; i < jobs.size(); i++) {
+        jobs[i].done();
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef DISKPOOL_H
+#define DISKPOOL_H
+
+#include <functional>
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define DISK_DEFAULT_THREADS 4
+#define DISK_THREADS_MAX 64
+
+// what a blocking step does, every operation has its own metrics
+#define DISK_LDAP 0 // directory connect, it blocks just like the disk does
+#define DISK_SEND 1
+#define DISK_LIST 2
+#define DISK_READ 3
+#define DISK_DEL 4
+#define DISK_CRED 5 // password hashing of the local credential database
+#define DISK_OPS 6
+
+// the epoll/uring loops hand blocking steps to a fixed number of threads
+// instead of running them on the loop thread, so a slow disk stalls the
+// sessions waiting for it and nobody else
+// a finished job goes to a completion queue and makes an eventfd readable,
+// the loop then runs its completion and resumes the session: sessions, their
+// sockets and the mail cache are only ever touched by the loop thread
+// per operation it counts jobs, queue depth (now and max), time queued and
+// time running (average and max), printed every --disk-stats seconds
+// fork mode children run their steps inline, they only serve one client
+
+extern int diskThreads;       // --disk-threads, 0 = steps run on the loop thread
+extern int diskStatsInterval; // --disk-stats, 0 = no metrics
+
+// starts the threads of this process, returns the eventfd the loop watches
+// for POLLIN; -1 if there are none (0 threads or error), steps run inline then
+int diskPoolStart();
+// running jobs finish, queued ones are dropped along with their completions
+// (the sessions waiting for them are destroyed next)
+void diskPoolStop();
+bool diskPoolRunning();
+
+// runs work on a pool thread, then done on the loop thread (diskComplete)
+void diskSubmit(int op, std::function<void()> work, std::function<void()> done);
+// runs the completions of finished jobs, call when the eventfd is readable
+void diskComplete();
+
+#endif
@@ -0,0 +1,374 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blacklist.h"
+#include "diskpool.h"
+#include "mailcache.h"
+#include "ratelimit.h"
+#include "server.h"
+#include "session.h"
+#include "util.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// EPOLL MODE
+// one process, edge-triggered epoll, every session is a coroutine that is
+// resumed when its socket becomes readable/writable, its blocking step
+// finished on the disk pool (diskpool.h) or the directory answered (the
+// LDAP socket is watched one-shot, with a timeout)
+// https://man7.org/linux/man-pages/man7/epoll.7.html
+
+#define MAX_EVENTS 256
+
+// data.ptr of the mailbox cache's inotify descriptor and the disk pool's eventfd
+static char notifyMarker;
+static char diskMarker;
+// data.ptr of a descriptor a session waits for: the connection, low bit set
+#define EPOLL_WATCH(conn) ((void *)((uintptr_t)(conn) | 1))
+#define EPOLL_IS_WATCH(ptr) (((uintptr_t)(ptr) & 1) != 0)
+#define EPOLL_WATCHER(ptr) ((epollConnection *)((uintptr_t)(ptr) & ~(uintptr_t)1))
+
+class epollConnection;
+
+// sessions resumed after the event batch, they may have finished
+static vector<epollConnection *> resumed;
+// sessions waiting for a descriptor, by when they give up
+static multimap<int64_t, epollConnection *> deadlines;
+
+class epollConnection : public connection {
+public:
+    std::coroutine_handle<> reader;
+    std::coroutine_handle<> writer;
+
+    int epollFd = -1;
+    int watchFd = -1; // waitReadable(), -1 = not waiting
+    std::coroutine_handle<> watcher;
+    multimap<int64_t, epollConnection *>::iterator watchDeadline;
+
+    bool offloads() override {
+        return diskPoolRunning();
+    }
+
+    void offload(int op, std::function<void()> work, std::coroutine_handle<> h) override {
+        diskSubmit(op, std::move(work), [this, h] {
+            h.resume();
+            resumed.push_back(this);
+        });
+    }
+
+    // read everything the kernel has (edge-triggered), straight into the parser
+    bool receive() override {
+        bool received = false;
+        while (true) {
+            size_t available;
+            char *dest = s.in.reserve(BUF, &available);
+            if (dest == NULL) {
+                return true; // full, the session handles what is there first
+            }
+
+            ssize_t size = recv(s.socket, dest, available, 0);
+            if (size == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return received;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("recv error");
+                s.closed = true;
+                return true;
+            }
+            if (size == 0) {
+                printf("Client closed remote socket\n"); // ignore error
+                s.closed = true;
+                return true;
+            }
+            s.in.commit(size);
+            received = true;
+        }
+    }
+
+    void waitReceive(std::coroutine_handle<> h) override {
+        reader = h;
+    }
+
+    // send as much as the socket takes
+    bool send() override {
+        while (!s.out.empty() && !s.closed) {
+            if (s.out.sendTo(s.socket, MSG_NOSIGNAL) == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break; // EPOLLOUT tells us when to continue
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("send failed");
+                s.closed = true;
+            }
+        }
+        if (s.closed) {
+            s.out.clear();
+        }
+        return s.out.empty();
+    }
+
+    void waitSend(std::coroutine_handle<> h) override {
+        writer = h;
+    }
+
+    bool watches() override {
+        return true;
+    }
+
+    void waitReadable(int fd, int timeoutMs, std::coroutine_handle<> h) override {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = EPOLL_WATCH(this);
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl add watch");
+            scheduler::waitReadable(fd, timeoutMs, h); // blocks the loop, but only this once
+            return;
+        }
+        watchFd = fd;
+        watcher = h;
+        watchDeadline = deadlines.emplace(nowMs() + timeoutMs, this);
+    }
+
+    // the descriptor is somebody else's, it must not stay in our epoll set
+    std::coroutine_handle<> unwatch() {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, watchFd, NULL);
+        deadlines.erase(watchDeadline);
+        watchFd = -1;
+        std::coroutine_handle<> h = watcher;
+        watcher = nullptr;
+        return h;
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+static int setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void closeConnection(int epollFd, epollConnection *conn, map<int, epollConnection *> &connections) {
+    if (conn->watchFd != -1) {
+        conn->unwatch();
+    }
+    stopSession(conn);
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->s.socket, NULL);
+    connections.erase(conn->s.socket);
+    if (close(conn->s.socket) == -1) {
+        perror("close session socket");
+    }
+    delete conn;
+}
+
+static void acceptConnections(int epollFd, map<int, epollConnection *> &connections) {
+    struct sockaddr_in cliaddress;
+    socklen_t addrlen;
+
+    while (true) {
+        addrlen = sizeof(struct sockaddr_in);
+        int fd = accept4(create_socket, (struct sockaddr *)&cliaddress, &addrlen, SOCK_NONBLOCK);
+        if (fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && !abortRequested) {
+                // EMFILE/ENFILE: out of descriptors, the rest stays in the backlog
+                perror("accept error");
+            }
+            return;
+        }
+        // banned networks and addresses over their rate never get a session
+        // (blacklist.h, ratelimit.h)
+        if (blacklistRange((struct sockaddr *)&cliaddress) || !rateAllowAddress((struct sockaddr *)&cliaddress)) {
+            close(fd);
+            continue;
+        }
+
+        epollConnection *conn = new epollConnection;
+        conn->epollFd = epollFd;
+        conn->s.socket = fd;
+        conn->s.sched = conn;
+        conn->s.clientIP = inet_ntoa(cliaddress.sin_addr);
+
+        // registered once for both directions, the waiting coroutine decides what matters
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl add session");
+            close(fd);
+            delete conn;
+            continue;
+        }
+        connections[fd] = conn;
+
+        startSession(conn);
+        if (conn->done) {
+            closeConnection(epollFd, conn, connections);
+        }
+    }
+}
+
+void epollLoop() {
+    struct epoll_event events[MAX_EVENTS];
+    map<int, epollConnection *> connections;
+
+    int epollFd = epoll_create1(0);
+    if (epollFd == -1) {
+        perror("epoll_create1");
+        return;
+    }
+
+    if (setNonBlocking(create_socket) == -1) {
+        perror("set listener non-blocking");
+        close(epollFd);
+        return;
+    }
+
+    // data.ptr == NULL marks the listening socket
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, create_socket, &ev) == -1) {
+        perror("epoll_ctl add listener");
+        close(epollFd);
+        return;
+    }
+
+    // mailbox changes of other processes reach the cache through the loop
+    int notifyFd = mailCacheInit();
+    if (notifyFd != -1) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &notifyMarker;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, notifyFd, &ev) == -1) {
+            perror("epoll_ctl add inotify");
+            mailCacheClose();
+        }
+    }
+
+    // blocking steps of the sessions come back through the loop as well
+    int diskFd = diskPoolStart();
+    if (diskFd != -1) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &diskMarker;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, diskFd, &ev) == -1) {
+            perror("epoll_ctl add eventfd");
+            diskPoolStop();
+        }
+    }
+
+    printf("Waiting for connections (epoll)...\n");
+
+    vector<epollConnection *> watchReady;
+    while (!abortRequested) {
+        // until the first session waiting for the directory gives up
+        int timeout = -1;
+        if (!deadlines.empty()) {
+            timeout = (int)max(deadlines.begin()->first - nowMs(), (int64_t)0);
+        }
+        int count = epoll_wait(epollFd, events, MAX_EVENTS, timeout);
+        if (count == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+                break;
+            }
+            continue;
+        }
+
+        bool diskReady = false;
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                acceptConnections(epollFd, connections);
+                continue;
+            }
+            if (events[i].data.ptr == &notifyMarker) {
+                mailCacheEvents();
+                continue;
+            }
+            if (events[i].data.ptr == &diskMarker) {
+                diskReady = true; // after the batch, later events may still refer to what it closes
+                continue;
+            }
+            if (EPOLL_IS_WATCH(events[i].data.ptr)) {
+                watchReady.push_back(EPOLL_WATCHER(events[i].data.ptr)); // after the batch as well
+                continue;
+            }
+
+            epollConnection *conn = (epollConnection *)events[i].data.ptr;
+            uint32_t what = events[i].events;
+
+            if ((what & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && conn->reader) {
+                std::coroutine_handle<> h = conn->reader;
+                conn->reader = nullptr;
+                h.resume();
+            }
+
+            if (!conn->done && (what & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && conn->writer) {
+                std::coroutine_handle<> h = conn->writer;
+                conn->writer = nullptr;
+                h.resume();
+            }
+
+            if (conn->done) {
+                closeConnection(epollFd, conn, connections);
+            }
+        }
+
+        // the directory answered or a session waited long enough
+        for (size_t i = 0; i < watchReady.size(); i++) {
+            epollConnection *conn = watchReady[i];
+            if (conn->watchFd != -1) {
+                conn->unwatch().resume();
+                resumed.push_back(conn);
+            }
+        }
+        watchReady.clear();
+        int64_t now = nowMs();
+        while (!deadlines.empty() && deadlines.begin()->first <= now) {
+            epollConnection *conn = deadlines.begin()->second;
+            conn->unwatch().resume();
+            resumed.push_back(conn);
+        }
+
+        if (diskReady) {
+            diskComplete();
+        }
+
+        // a session resumed by its descriptor may have finished a disk step too
+        sort(resumed.begin(), resumed.end());
+        resumed.erase(unique(resumed.begin(), resumed.end()), resumed.end());
+        for (size_t i = 0; i < resumed.size(); i++) {
+            if (resumed[i]->done) {
+                closeConnection(epollFd, resumed[i], connections);
+            }
+        }
+        resumed.clear();
+    }
+
+    // no thread may still work for a session that is destroyed
+    diskPoolStop();
+    while (!connections.empty()) {
+        closeConnection(epollFd, connections.begin()->second, connections);
+    }
+    mailCacheClose();
+    close(epollFd);
+}
@@ -0,0 +1,134 @@
+#include <atomic>
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "groupcommit.h"
+#include "util.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// how often a leader looks whether the deliveries it waits for are done
+#define COMMIT_POLL_US 50
+// how long a waiter sleeps before it checks that the leader still lives
+#define LEADER_CHECK_NS (10 * 1000 * 1000)
+
+// lives in shared memory, so only lock-free atomics in here
+struct commitState {
+    atomic<uint64_t> requested;  // tickets handed out
+    atomic<uint64_t> durable;    // every ticket up to this one is synced
+    atomic<uint64_t> failed;     // a sync covering tickets up to this one failed
+    atomic<int32_t> writing;     // deliveries between commitEnter() and commitLeave()
+    atomic<int32_t> waiting;     // of those, the ones in groupCommit()
+    atomic<int32_t> leader;      // pid of the process syncing, 0 = none
+    atomic<uint32_t> generation; // futex word, bumped after every sync
+};
+
+static_assert(atomic<uint64_t>::is_always_lock_free && atomic<int32_t>::is_always_lock_free &&
+              atomic<uint32_t>::is_always_lock_free);
+static_assert(sizeof(atomic<uint32_t>) == sizeof(uint32_t), "the kernel waits on the plain word");
+
+int syncMode = SYNC_GROUP;
+int commitWindow = COMMIT_DEFAULT_WINDOW;
+
+static commitState *state = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// not FUTEX_PRIVATE_FLAG, the word is shared between processes
+// https://man7.org/linux/man-pages/man2/futex.2.html
+static long futex(atomic<uint32_t> *word, int op, uint32_t value, const struct timespec *timeout) {
+    return syscall(SYS_futex, (uint32_t *)word, op, value, timeout, NULL, 0);
+}
+
+// called with state->leader set to this process
+static void leadCommit(int fd) {
+    // deliveries still writing get the window to take a ticket as well
+    int64_t deadline = nowUs() + commitWindow;
+    while (state->writing.load(memory_order_acquire) > state->waiting.load(memory_order_acquire) &&
+           nowUs() < deadline) {
+        usleep(COMMIT_POLL_US);
+    }
+
+    // every ticket up to here belongs to bytes already written
+    uint64_t target = state->requested.load(memory_order_acquire);
+    if (syncfs(fd) == -1) {
+        perror("syncfs");
+        state->failed.store(target, memory_order_release);
+    }
+    state->durable.store(target, memory_order_release);
+    state->leader.store(0, memory_order_release);
+
+    state->generation.fetch_add(1, memory_order_release);
+    futex(&state->generation, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int groupCommitInit() {
+    // zero filled, no tickets, no leader
+    void *mem = mmap(NULL, sizeof(commitState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap group commit");
+        return -1;
+    }
+    state = (commitState *)mem;
+    return 0;
+}
+
+void commitEnter() {
+    if (state != NULL) {
+        state->writing.fetch_add(1, memory_order_release);
+    }
+}
+
+void commitLeave() {
+    if (state != NULL) {
+        state->writing.fetch_sub(1, memory_order_release);
+    }
+}
+
+int groupCommit(int fd) {
+    if (state == NULL) {
+        return syncfs(fd);
+    }
+
+    uint64_t ticket = state->requested.fetch_add(1, memory_order_acq_rel) + 1;
+    state->waiting.fetch_add(1, memory_order_release);
+
+    while (state->durable.load(memory_order_acquire) < ticket) {
+        uint32_t generation = state->generation.load(memory_order_acquire);
+        if (state->durable.load(memory_order_acquire) >= ticket) {
+            break;
+        }
+
+        int32_t none = 0;
+        if (state->leader.compare_exchange_strong(none, getpid(), memory_order_acq_rel)) {
+            leadCommit(fd);
+            continue;
+        }
+
+        // sleep until the current sync is done, a sync that started before our
+        // ticket doesn't cover it, the loop then leads or waits for the next one
+        struct timespec timeout = {0, LEADER_CHECK_NS};
+        if (futex(&state->generation, FUTEX_WAIT, generation, &timeout) == -1 && errno == ETIMEDOUT) {
+            int32_t pid = state->leader.load(memory_order_acquire);
+            if (pid != 0 && kill(pid, 0) == -1 && errno == ESRCH) {
+                state->leader.compare_exchange_strong(pid, 0, memory_order_acq_rel);
+            }
+        }
+    }
+    state->waiting.fetch_sub(1, memory_order_release);
+
+    // may also report a failure for a ticket an earlier sync covered already
+    return ticket <= state->failed.load(memory_order_acquire) ? -1 : 0;
+}
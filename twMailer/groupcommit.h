@@ -0,0 +1,43 @@
+#ifndef GROUPCOMMIT_H
+#define GROUPCOMMIT_H
+
+///////////////////////////////////////////////////////////////////////////////
+
+// how SEND makes a message durable before it answers OK (--sync)
+#define SYNC_OFF 0   // not at all, the page cache writes it back some time
+#define SYNC_EACH 1  // fdatasync()/fsync() of every file a delivery touched
+#define SYNC_GROUP 2 // deliveries in flight share one syncfs() (default)
+
+// microseconds a group commit waits for deliveries still writing (--commit-window)
+// 0: no waiting, the deliveries arriving during one sync form the next batch
+#define COMMIT_DEFAULT_WINDOW 0
+
+// group commit: a delivery takes a ticket once its bytes are written and
+// waits until a sync covering the ticket is done; the first waiter becomes the
+// leader, waits up to the window while other deliveries are still writing,
+// then one syncfs() of the spool makes every ticket handed out so far durable
+// and wakes the rest (futex on shared memory)
+// the counters live in anonymous shared memory set up before the
+// workers/children are forked, so deliveries of all processes form one batch
+// a leader that died is replaced once a waiter notices
+
+extern int syncMode;
+extern int commitWindow;
+
+// -1 if the shared memory can't be set up, every group commit syncs alone then
+int groupCommitInit();
+
+// a delivery is writing, leaders wait for it (within the window)
+void commitEnter();
+void commitLeave();
+
+struct commitScope {
+    commitScope() { commitEnter(); }
+    ~commitScope() { commitLeave(); }
+};
+
+// everything this process wrote so far is durable once it returns 0
+// fd is any open file on the spool filesystem, -1 on error
+int groupCommit(int fd);
+
+#endif
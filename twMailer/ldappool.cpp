@@ -0,0 +1,151 @@
+#include <mutex>
+#include <stdio.h>
+#include <vector>
+
+#include "ldappool.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+const char *ldapUri = LDAP_DEFAULT_URI;
+int ldapPoolSize = LDAP_DEFAULT_POOL;
+int ldapTimeout = LDAP_DEFAULT_TIMEOUT;
+
+// blocking steps may run on other threads, so the pool is locked
+static mutex poolLock;
+static vector<LDAP *> idle;
+
+///////////////////////////////////////////////////////////////////////////////
+
+LDAP *ldapConnect() {
+    // LDAP config
+    // anonymous bind with user and pw empty
+    const int ldapVersion = LDAP_VERSION3;
+
+    int rc = 0; // return code
+
+    // setup LDAP connection
+    LDAP *ldapHandle;
+
+    rc = ldap_initialize(&ldapHandle, ldapUri);
+
+    if (rc != LDAP_SUCCESS)
+    {
+        fprintf(stderr, "ldap_init failed\n");
+        return NULL;
+    }
+
+    printf("connected to LDAP server %s\n", ldapUri);
+
+    // set verison options
+    rc = ldap_set_option(ldapHandle, LDAP_OPT_PROTOCOL_VERSION, &ldapVersion);             // IN-Value
+
+    if (rc != LDAP_OPT_SUCCESS){
+        fprintf(stderr, "ldap_set_option(PROTOCOL_VERSION): %s\n", ldap_err2string(rc));
+        ldap_unbind_ext_s(ldapHandle, NULL, NULL);
+        return NULL;
+    }
+
+    // a directory that doesn't answer must not hold the connect forever
+    struct timeval timeout = {ldapTimeout, 0};
+    ldap_set_option(ldapHandle, LDAP_OPT_NETWORK_TIMEOUT, &timeout);
+    ldap_set_option(ldapHandle, LDAP_OPT_TIMEOUT, &timeout);
+
+    // start connection secure (initialize TLS)
+    rc = ldap_start_tls_s(ldapHandle, NULL, NULL);
+
+    if (rc != LDAP_SUCCESS){
+        fprintf(stderr, "ldap_start_tls_s(): %s\n", ldap_err2string(rc));
+        ldap_unbind_ext_s(ldapHandle, NULL, NULL);
+        return NULL;
+    }
+
+    return ldapHandle;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void ldapPoolAdd() {
+    LDAP *ldapHandle = ldapConnect();
+    if (ldapHandle == NULL) {
+        fprintf(stderr, "LDAP pool: directory not reachable, connecting on demand\n");
+        return;
+    }
+    ldapGiveBack(ldapHandle, false);
+}
+
+LDAP *ldapIdle() {
+    lock_guard<mutex> guard(poolLock);
+    if (idle.empty()) {
+        return NULL;
+    }
+    LDAP *ldapHandle = idle.back();
+    idle.pop_back();
+    return ldapHandle;
+}
+
+void ldapGiveBack(LDAP *ldapHandle, bool broken) {
+    if (!broken) {
+        lock_guard<mutex> guard(poolLock);
+        if (idle.size() < LDAP_POOL_MAX) {
+            idle.push_back(ldapHandle);
+            return;
+        }
+    }
+    ldap_unbind_ext_s(ldapHandle, NULL, NULL);
+}
+
+bool ldapBroken(int rc) {
+    return rc == LDAP_SERVER_DOWN || rc == LDAP_CONNECT_ERROR || rc == LDAP_TIMEOUT ||
+           rc == LDAP_LOCAL_ERROR;
+}
+
+void ldapPoolClose() {
+    lock_guard<mutex> guard(poolLock);
+    for (size_t i = 0; i < idle.size(); i++) {
+        ldap_unbind_ext_s(idle[i], NULL, NULL);
+    }
+    idle.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int ldapBindStart(LDAP *ldapHandle, const char *dn, BerValue *credentials, int *msgid) {
+    return ldap_sasl_bind(ldapHandle, dn, LDAP_SASL_SIMPLE, credentials, NULL, NULL, msgid);
+}
+
+int ldapBindResult(LDAP *ldapHandle, int msgid, bool *finished) {
+    // zero timeout: only what already arrived
+    struct timeval zero = {0, 0};
+    LDAPMessage *result = NULL;
+    int type = ldap_result(ldapHandle, msgid, LDAP_MSG_ALL, &zero, &result);
+    if (type == 0) {
+        *finished = false;
+        return LDAP_SUCCESS;
+    }
+
+    *finished = true;
+    if (type == -1) {
+        int rc = LDAP_SERVER_DOWN;
+        ldap_get_option(ldapHandle, LDAP_OPT_RESULT_CODE, &rc);
+        return rc;
+    }
+    int rc = LDAP_OTHER;
+    if (ldap_parse_result(ldapHandle, result, &rc, NULL, NULL, NULL, NULL, 1) != LDAP_SUCCESS) {
+        return LDAP_OTHER;
+    }
+    return rc;
+}
+
+void ldapBindAbandon(LDAP *ldapHandle, int msgid) {
+    ldap_abandon_ext(ldapHandle, msgid, NULL, NULL);
+}
+
+int ldapDescriptor(LDAP *ldapHandle) {
+    int fd = -1;
+    if (ldap_get_option(ldapHandle, LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS) {
+        return -1;
+    }
+    return fd;
+}
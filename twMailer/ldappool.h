@@ -0,0 +1,59 @@
+#ifndef LDAPPOOL_H
+#define LDAPPOOL_H
+
+//ldap
+#include <ldap.h>
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define LDAP_DEFAULT_URI "ldap://ldap.technikum-wien.at:389"
+// connections an event loop process opens ahead (--ldap-pool)
+#define LDAP_DEFAULT_POOL 4
+// idle connections kept, more are closed when they come back
+#define LDAP_POOL_MAX 64
+// seconds the directory has to answer a bind or a connect (--ldap-timeout)
+#define LDAP_DEFAULT_TIMEOUT 5
+
+// directory connections shared by all sessions of one process
+// a LOGIN borrows one, binds and gives it back, so connect + StartTLS happen
+// once per burst instead of once per client
+// nothing is opened before the first LOGIN: accepting and the welcome never
+// wait for the directory, a client that quits right away costs it nothing;
+// the first LOGIN of an epoll/uring process opens the rest of the pool on the
+// disk pool (ldapPoolAdd) while it connects for itself
+// a TLS connection can't be shared between processes: every worker has its
+// own pool and a fork mode child borrows from its own (empty) pool on LOGIN
+// binds are asynchronous: ldapBindStart() sends the request, the session
+// waits for the connection's descriptor to become readable (the event loop
+// watches it, see readable in task.h) and ldapBindResult() picks the answer
+// up without blocking, so many LOGINs can wait for the directory at once,
+// one bind per connection
+
+extern const char *ldapUri; // --ldap, e.g. a local slapd or mock for tests
+extern int ldapPoolSize;    // --ldap-pool
+extern int ldapTimeout;     // --ldap-timeout
+
+// one TLS-negotiated connection, NULL on error
+LDAP *ldapConnect();
+
+// opens one more idle connection, the directory being down is not fatal
+void ldapPoolAdd();
+// an idle connection, NULL if there is none (ldapConnect() then)
+// pooled connections are bound as whoever used them last, bind before use
+LDAP *ldapIdle();
+// broken: the connection failed, it is closed instead of kept
+void ldapGiveBack(LDAP *ldapHandle, bool broken);
+// true if rc means the connection itself is gone
+bool ldapBroken(int rc);
+void ldapPoolClose();
+
+// sends a simple bind, LDAP_SUCCESS and *msgid set if it went out
+int ldapBindStart(LDAP *ldapHandle, const char *dn, BerValue *credentials, int *msgid);
+// the bind's result code once *finished, never waits
+int ldapBindResult(LDAP *ldapHandle, int msgid, bool *finished);
+// gives up on a bind that took too long
+void ldapBindAbandon(LDAP *ldapHandle, int msgid);
+// the socket to wait on, -1 on error
+int ldapDescriptor(LDAP *ldapHandle);
+
+#endif
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lineparser.h"
+#include "protocol.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define MIN_CAPACITY 4096
+
+lineParser::lineParser() {}
+
+lineParser::~lineParser() {
+    free(buffer);
+}
+
+char *lineParser::reserve(size_t min, size_t *available) {
+    if (capacity - tail < min && head > 0) {
+        // move the unhandled rest to the front (offsets are relative to head)
+        memmove(buffer, buffer + head, tail - head);
+        tail -= head;
+        scan -= head;
+        head = 0;
+    }
+
+    if (capacity - tail < min) {
+        if (tail >= MAX_COMMAND_SIZE) {
+            return NULL;
+        }
+        size_t newCapacity = capacity ? capacity : MIN_CAPACITY;
+        while (newCapacity - tail < min) {
+            newCapacity *= 2;
+        }
+        if (newCapacity > MAX_COMMAND_SIZE) {
+            newCapacity = MAX_COMMAND_SIZE;
+        }
+        char *grown = (char *)realloc(buffer, newCapacity);
+        if (grown == NULL) {
+            return NULL;
+        }
+        buffer = grown;
+        capacity = newCapacity;
+    }
+
+    *available = capacity - tail;
+    return buffer + tail;
+}
+
+void lineParser::commit(size_t count) {
+    tail += count;
+}
+
+bool lineParser::append(const char *data, size_t count) {
+    while (count > 0) {
+        size_t available;
+        char *dest = reserve(count, &available);
+        if (dest == NULL) {
+            return false;
+        }
+        size_t n = count < available ? count : available;
+        memcpy(dest, data, n);
+        commit(n);
+        data += n;
+        count -= n;
+    }
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool lineParser::complete() const {
+    if (lines.empty()) {
+        return false;
+    }
+
+    std::string_view command(buffer + head + lines[0].first, lines[0].second);
+    size_t count = lines.size();
+
+    if (command == "LOGIN") {
+        return count >= 3;
+    }
+    if (command == "READ" || command == "DEL") {
+        return count >= 2;
+    }
+    if (command == "SEND") {
+        // receiver, subject, body lines, then "." (the body may be empty,
+        // the session answers that with ERR)
+        const std::pair<size_t, size_t> &last = lines[count - 1];
+        return count >= 4 && last.second == 1 && buffer[head + last.first] == '.';
+    }
+    return true;
+}
+
+// a v2 frame: header, then as many length prefixed fields as it says,
+// which have to fill its body exactly
+int lineParser::nextFrame(std::vector<std::string_view> &out) {
+    if (tail - head < V2_HEADER_SIZE) {
+        return 0;
+    }
+    const char *frame = buffer + head;
+    uint32_t length = v2Get32(frame + 8);
+    if (length > MAX_COMMAND_SIZE - V2_HEADER_SIZE) {
+        return -1;
+    }
+    if (tail - head < V2_HEADER_SIZE + length) {
+        return 0;
+    }
+
+    out.clear();
+    out.push_back(v2CommandName((unsigned char)frame[0]));
+    const char *field = frame + V2_HEADER_SIZE;
+    const char *end = field + length;
+    for (uint16_t i = v2Get16(frame + 2); i > 0; i--) {
+        if (end - field < 4 || (size_t)(end - field - 4) < v2Get32(field)) {
+            return -1;
+        }
+        out.push_back(std::string_view(field + 4, v2Get32(field)));
+        field += 4 + v2Get32(field);
+    }
+    if (field != end) {
+        return -1;
+    }
+
+    frameId = v2Get32(frame + 4);
+    lineStart = V2_HEADER_SIZE + length;
+    scan = head + lineStart;
+    ready = true;
+    return 1;
+}
+
+int lineParser::next(std::vector<std::string_view> &out) {
+    if (v2) {
+        return nextFrame(out);
+    }
+    while (!ready) {
+        char *newline = scan < tail ? (char *)memchr(buffer + scan, '\n', tail - scan) : NULL;
+        if (newline == NULL) {
+            scan = tail;
+            return tail - head >= MAX_COMMAND_SIZE ? -1 : 0;
+        }
+
+        size_t end = newline - buffer;
+        size_t start = head + lineStart;
+        size_t length = end - start;
+        if (length > 0 && buffer[end - 1] == '\r') {
+            length--;
+        }
+        lines.push_back(std::make_pair(lineStart, length));
+
+        scan = end + 1;
+        lineStart = scan - head;
+        ready = complete();
+    }
+
+    out.clear();
+    for (size_t i = 0; i < lines.size(); i++) {
+        out.push_back(std::string_view(buffer + head + lines[i].first, lines[i].second));
+    }
+    return 1;
+}
+
+void lineParser::consume() {
+    if (!ready) {
+        return;
+    }
+    head += lineStart;
+    lineStart = 0;
+    lines.clear();
+    ready = false;
+
+    if (head == tail) {
+        head = tail = scan = 0;
+    }
+}
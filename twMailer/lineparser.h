@@ -0,0 +1,77 @@
+#ifndef LINEPARSER_H
+#define LINEPARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+
+// biggest single command (a SEND with its whole body) a client may send
+#define MAX_COMMAND_SIZE (8 * 1024 * 1024)
+
+// incremental framing of the text protocol, and of v2 (protocol.h) once the
+// session switched
+// bytes are received straight into the parser's buffer, every byte is looked
+// at once (memchr) no matter how the command is split over reads, complete
+// commands come out as string_views into the buffer
+//
+// a command is complete after
+//   LOGIN            3 lines (LOGIN, user, password)
+//   READ, DEL        2 lines (command, message number)
+//   SEND             the line "." after receiver and subject
+//   anything else    1 line
+//
+// in v2 only the frame header and the field lengths are read, a frame comes
+// out like a text command: its type by name ("" if unknown), then the fields
+class lineParser {
+public:
+    lineParser();
+    ~lineParser();
+    lineParser(const lineParser &) = delete;
+    lineParser &operator=(const lineParser &) = delete;
+
+    // room for at least min more bytes, *available says how much there is
+    // NULL if the buffer is at MAX_COMMAND_SIZE
+    // moves buffered bytes, views from next() are invalid afterwards
+    char *reserve(size_t min, size_t *available);
+    void commit(size_t count);
+    // reserve() + memcpy() + commit(), false if the limit was hit
+    bool append(const char *data, size_t count);
+
+    // 1: a complete command is in lines (valid until consume()/reserve())
+    // 0: needs more bytes
+    // -1: the command does not fit into MAX_COMMAND_SIZE (or, in v2, is not
+    //     a frame)
+    int next(std::vector<std::string_view> &lines);
+    // drop the command returned by next()
+    void consume();
+
+    // v2 framing from the next command on, after consume()
+    void useV2() { v2 = true; }
+    // of the v2 frame returned by next()
+    uint32_t requestId() const { return frameId; }
+
+    size_t buffered() const { return tail - head; }
+
+private:
+    bool complete() const;
+    int nextFrame(std::vector<std::string_view> &fields);
+
+    char *buffer = NULL;
+    size_t capacity = 0;
+    size_t head = 0;      // first byte of the current command
+    size_t tail = 0;      // end of received bytes
+    size_t scan = 0;      // first byte not looked at yet
+    size_t lineStart = 0; // start of the current line, relative to head
+    bool ready = false;   // the current command is complete
+    bool v2 = false;
+    uint32_t frameId = 0;
+
+    // lines of the current command, offset relative to head and length
+    std::vector<std::pair<size_t, size_t>> lines;
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "lineparser.h"
+#include "protocol.h"
+#include "test.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// the commands the parser makes of input, each joined with '|' (in v2 after
+// its request id and ':')
+// step: bytes fed at once, to split commands over reads
+static vector<string> frame(const string &input, size_t step = 0, bool v2 = false) {
+    lineParser in;
+    if (v2) {
+        in.useV2();
+    }
+    vector<string> commands;
+    vector<string_view> lines;
+    size_t fed = 0;
+    while (true) {
+        int rc = in.next(lines);
+        if (rc == 1) {
+            string command = v2 ? to_string(in.requestId()) + ":" : "";
+            for (size_t i = 0; i < lines.size(); i++) {
+                command += (i ? "|" : "") + string(lines[i]);
+            }
+            commands.push_back(command);
+            in.consume();
+            continue;
+        }
+        if (rc < 0) {
+            commands.push_back("<too long>");
+            break;
+        }
+        if (fed == input.size()) {
+            break;
+        }
+        size_t count = step == 0 ? input.size() - fed : min(step, input.size() - fed);
+        in.append(input.data() + fed, count);
+        fed += count;
+    }
+    return commands;
+}
+
+static void checkBothWays(const string &input, const vector<string> &expected, bool v2 = false) {
+    CHECK(frame(input, 0, v2) == expected);
+    CHECK(frame(input, 1, v2) == expected);
+}
+
+// a v2 frame with a field count and length of its own
+static string rawFrame(int type, uint32_t requestId, uint16_t fields, const string &body) {
+    return v2Header(type, 0, requestId, fields, body.size()) + body;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main() {
+    // commands and how many lines make them complete
+    checkBothWays("LIST\nQUIT\n", {"LIST", "QUIT"});
+    checkBothWays("LOGIN\nbob\nsecret\nLIST\n", {"LOGIN|bob|secret", "LIST"});
+    checkBothWays("READ\n3\nDEL\n4\n", {"READ|3", "DEL|4"});
+    checkBothWays("LOGIN\r\nbob\r\nsecret\r\n", {"LOGIN|bob|secret"});
+
+    // SEND ends with the line "."
+    checkBothWays("SEND\nbob\nhi\nline 1\nline 2\n.\nLIST\n", {"SEND|bob|hi|line 1|line 2|.", "LIST"});
+    checkBothWays("SEND\nbob\nhi\n..\n. \n.\n", {"SEND|bob|hi|..|. |."});
+    checkBothWays("SEND\r\nbob\r\nhi\r\nbody\r\n.\r\n", {"SEND|bob|hi|body|."});
+    // an empty body ends the command as well, the next one isn't swallowed
+    checkBothWays("SEND\nbob\nhi\n.\nLIST\n", {"SEND|bob|hi|.", "LIST"});
+    // "." as receiver or subject doesn't end it
+    checkBothWays("SEND\n.\n.\nbody\n.\n", {"SEND|.|.|body|."});
+    // incomplete commands wait for more
+    checkBothWays("SEND\nbob\nhi\nbody\n", {});
+    checkBothWays("LOGIN\nbob\n", {});
+    checkBothWays("LIST", {});
+
+    // a command that never ends within MAX_COMMAND_SIZE
+    string endless = "SEND\nbob\nhi\n" + string(MAX_COMMAND_SIZE, 'x');
+    CHECK(frame(endless) == vector<string>{"<too long>"});
+    CHECK(frame(endless, 64 * 1024) == vector<string>{"<too long>"});
+
+    // v2: fields by their lengths, any bytes in them
+    checkBothWays(v2Frame(V2_LOGIN, 0, 7, {"bob", "secret"}) + v2Frame(V2_LIST, 0, 8, {}),
+                  {"7:LOGIN|bob|secret", "8:LIST"}, true);
+    string body("line\n.\n\0\r\nend", 14);
+    checkBothWays(v2Frame(V2_SEND, 0, 1, {"bob,alice", "hi", body}), {"1:SEND|bob,alice|hi|" + body}, true);
+    checkBothWays(v2Frame(V2_SEND, 0, 2, {"bob", "", ""}), {"2:SEND|bob||"}, true);
+    checkBothWays(v2Frame(V2_READ, 0, 0xffffffff, {v2Number(3)}), {"4294967295:READ|" + v2Number(3)}, true);
+    // unknown types come out without a name, the session answers ERR
+    checkBothWays(v2Frame(0x42, 0, 3, {"x"}), {"3:|x"}, true);
+    // incomplete frames wait for more
+    checkBothWays(v2Frame(V2_LOGIN, 0, 1, {"bob", "secret"}).substr(0, 11), {}, true);
+    checkBothWays(v2Frame(V2_LOGIN, 0, 1, {"bob", "secret"}).substr(0, 20), {}, true);
+
+    // fields that don't fill the body exactly, or run past it
+    string field = v2Frame(V2_LIST, 0, 0, {"abc"}).substr(V2_HEADER_SIZE);
+    checkBothWays(rawFrame(V2_LIST, 1, 1, field + "x"), {"<too long>"}, true);
+    checkBothWays(rawFrame(V2_LIST, 1, 2, field), {"<too long>"}, true);
+    checkBothWays(rawFrame(V2_LIST, 1, 0, field), {"<too long>"}, true);
+    checkBothWays(rawFrame(V2_LIST, 1, 1, v2Number(0xfffffff0) + "abc"), {"<too long>"}, true);
+    // a body bigger than MAX_COMMAND_SIZE is refused from its header on
+    CHECK(frame(v2Header(V2_SEND, 0, 1, 3, MAX_COMMAND_SIZE), 0, true) == vector<string>{"<too long>"});
+
+    return testResult("lineparsertest");
+}
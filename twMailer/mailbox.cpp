@@ -0,0 +1,961 @@
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <set>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// directory management
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "groupcommit.h"
+#include "mailbox.h"
+#include "util.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define INDEX_MAGIC "TWIX"
+#define INDEX_VERSION 2
+
+struct indexHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t count;   // records behind the header
+    uint64_t nextId;  // id of the next delivered message
+    uint64_t segment; // segment new entries are appended to
+};
+
+static_assert(sizeof(indexHeader) == 32, "the index header is 32 bytes on disk");
+
+// version 1 records (no segments, longer subjects), upgraded on first use
+struct mailRecordV1 {
+    uint64_t id;
+    int64_t timestamp;
+    uint64_t subjectHash;
+    uint32_t size;
+    uint8_t senderLen;
+    uint8_t subjectLen;
+    uint8_t reserved[2];
+    char sender[16];
+    char subject[80];
+};
+
+static_assert(sizeof(mailRecordV1) == sizeof(mailRecord), "upgrades are done in place");
+
+#define SEGMENT_MAGIC 0x47535754 // "TWSG"
+#define SEGMENT_MESSAGE 1
+#define SEGMENT_TOMBSTONE 2
+
+// in front of every message and tombstone in a segment
+struct segmentEntry {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t id;     // message id, see mailRecord
+    uint32_t length; // bytes following this header
+    uint32_t reserved;
+};
+
+static_assert(sizeof(segmentEntry) == 24, "segment entries have a 24 byte header on disk");
+
+// a segment is compacted once more than this share of it is dead
+#define COMPACT_DEAD_PERCENT 50
+// seconds until a file in tmp/ counts as left over (like maildir)
+#define TMP_MAX_AGE (36 * 3600)
+
+int mailboxStorage = STORAGE_FILES;
+
+// the mapped index, records start right after the header
+struct indexMap {
+    char *base = NULL;
+    size_t length = 0;
+
+    indexHeader *header() { return (indexHeader *)base; }
+    mailRecord *records() { return (mailRecord *)(base + sizeof(indexHeader)); }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+string mailboxDir(const string &user) {
+    // the top bits of FNV-1a hardly depend on the last characters (user1,
+    // user2, ...), mixed like the MurmurHash3 finalizer they do
+    uint64_t hash = stringHash(user);
+    hash = (hash ^ (hash >> 33)) * 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    char shard[16];
+    snprintf(shard, sizeof(shard), MAILBOX_SHARD "%02X/" MAILBOX_SHARD "%02X/", (unsigned)(hash >> 56),
+             (unsigned)(hash >> 48) & 0xff);
+    return MAILBOX_ROOT + string(shard) + user;
+}
+
+// shard directories are MAILBOX_SHARD and two upper case hex digits, no user
+// name looks like that (see mailbox.h)
+static bool isShard(const string &name) {
+    return name.size() == 3 && name[0] == MAILBOX_SHARD[0] && isxdigit(name[1]) && isxdigit(name[2]) &&
+           !islower(name[1]) && !islower(name[2]);
+}
+
+static string messagePath(const string &dir, uint64_t id) {
+    return dir + "/" + to_string(id) + ".msg";
+}
+
+static string segmentPath(const string &dir, uint64_t segment) {
+    return dir + "/" + to_string(segment) + ".seg";
+}
+
+static void fillRecord(mailRecord &record, uint64_t id, const string &sender, const string &subject,
+                       uint32_t size, int64_t timestamp) {
+    memset(&record, 0, sizeof(record));
+    record.id = id;
+    record.storage = STORAGE_FILES;
+    record.timestamp = timestamp;
+    record.subjectHash = stringHash(subject);
+    record.size = size;
+    record.senderLen = min(sender.size(), (size_t)MAIL_SENDER_MAX);
+    memcpy(record.sender, sender.data(), record.senderLen);
+    record.subjectLen = min(subject.size(), (size_t)MAIL_SUBJECT_MAX);
+    memcpy(record.subject, subject.data(), record.subjectLen);
+}
+
+// all of iov at offset, -1 on error
+static int writeVector(int fd, struct iovec *iov, int count, off_t offset) {
+    while (count > 0) {
+        ssize_t n = pwritev(fd, iov, count, offset);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        offset += n;
+
+        // drop what is written
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static int writeAll(int fd, const void *data, size_t size, off_t offset) {
+    struct iovec iov = {(void *)data, size};
+    return writeVector(fd, &iov, 1, offset);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// first index of a mailbox, called with the index locked exclusively and empty
+// messages stored before there was an index are adopted in readdir order
+static int createIndex(const string &dir, int fd, indexHeader &header) {
+    vector<mailRecord> records;
+    uint64_t id = 0;
+
+    // names first, renaming while reading the directory would list files twice
+    vector<string> names;
+    DIR *directoryPointer = opendir(dir.c_str());
+    if (directoryPointer == NULL) {
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(directoryPointer)) != NULL) {
+        if (entry->d_type == DT_REG && entry->d_name[0] != '.') {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(directoryPointer);
+
+    for (size_t i = 0; i < names.size(); i++) {
+        string oldPath = dir + "/" + names[i];
+
+        // sender, receiver and subject are the first lines of a message
+        string sender, receiver, subject;
+        ifstream file(oldPath);
+        getline(file, sender);
+        getline(file, receiver);
+        getline(file, subject);
+        file.close();
+
+        struct stat fileStat;
+        if (stat(oldPath.c_str(), &fileStat) == -1 || rename(oldPath.c_str(), messagePath(dir, id).c_str()) == -1) {
+            perror("adopting message");
+            continue;
+        }
+        mailRecord record;
+        fillRecord(record, id, sender, subject, fileStat.st_size, fileStat.st_mtime);
+        records.push_back(record);
+        id++;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, 4);
+    header.version = INDEX_VERSION;
+    header.count = records.size();
+    header.nextId = id;
+
+    // records first, the header makes them count
+    if (writeAll(fd, records.data(), records.size() * sizeof(mailRecord), sizeof(header)) == -1 ||
+        writeAll(fd, &header, sizeof(header), 0) == -1) {
+        return -1;
+    }
+    if (!records.empty()) {
+        printf("Indexed %zu existing messages in %s\n", records.size(), dir.c_str());
+    }
+    return 0;
+}
+
+// rewrites version 1 records, called with the index locked exclusively
+static int upgradeIndex(int fd, indexHeader &header) {
+    vector<mailRecordV1> old(header.count);
+    size_t bytes = old.size() * sizeof(mailRecordV1);
+    if (pread(fd, old.data(), bytes, sizeof(header)) != (ssize_t)bytes) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    vector<mailRecord> records(old.size());
+    for (size_t i = 0; i < old.size(); i++) {
+        string sender(old[i].sender, old[i].senderLen);
+        string subject(old[i].subject, old[i].subjectLen);
+        fillRecord(records[i], old[i].id, sender, subject, old[i].size, old[i].timestamp);
+        records[i].subjectHash = old[i].subjectHash; // of the whole subject
+    }
+
+    header.version = INDEX_VERSION;
+    header.segment = 0;
+    if (writeAll(fd, records.data(), bytes, sizeof(header)) == -1 || writeAll(fd, &header, sizeof(header), 0) == -1) {
+        return -1;
+    }
+    printf("Upgraded index with %zu messages\n", records.size());
+    return 0;
+}
+
+// opens the index of a mailbox directory under flock(lock), creates it if needed
+// -1 and errno ENOENT if the mailbox doesn't exist
+static int openIndex(const string &dir, int lock, indexHeader &header) {
+    int fd = open((dir + "/" MAILBOX_INDEX).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    if (flock(fd, lock) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    ssize_t size = pread(fd, &header, sizeof(header), 0);
+    if (size == 0 || (size == sizeof(header) && header.version == 1)) {
+        // new or old index, only one process builds or upgrades it
+        flock(fd, LOCK_EX);
+        size = pread(fd, &header, sizeof(header), 0);
+        if (size == 0) {
+            if (createIndex(dir, fd, header) == -1) {
+                perror("create index");
+                close(fd);
+                return -1;
+            }
+            size = sizeof(header);
+        } else if (size == sizeof(header) && header.version == 1 && upgradeIndex(fd, header) == -1) {
+            perror("upgrade index");
+            close(fd);
+            return -1;
+        }
+        flock(fd, lock);
+    }
+
+    if (size != sizeof(header) || memcmp(header.magic, INDEX_MAGIC, 4) != 0 || header.version != INDEX_VERSION) {
+        fprintf(stderr, "%s/%s is damaged\n", dir.c_str(), MAILBOX_INDEX);
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    return fd;
+}
+
+// creates the shard directories dir is in
+static int makeShard(const string &dir) {
+    size_t slash = strlen(MAILBOX_ROOT);
+    while ((slash = dir.find('/', slash)) != string::npos) {
+        if (mkdir(dir.substr(0, slash).c_str(), 0777) == -1 && errno != EEXIST) {
+            return -1;
+        }
+        slash++;
+    }
+    return 0;
+}
+
+// true while fd is the index found at dir
+static bool indexInPlace(const string &dir, int fd) {
+    struct stat pathStat, fdStat;
+    return stat((dir + "/" MAILBOX_INDEX).c_str(), &pathStat) == 0 && fstat(fd, &fdStat) == 0 &&
+           pathStat.st_dev == fdStat.st_dev && pathStat.st_ino == fdStat.st_ino;
+}
+
+// moves the mailbox MAILBOX_ROOT/<user> to its shard, under the exclusive lock
+// of its index, so nobody is in the middle of using it
+// 0 if it was moved (by this or another process), -1 and errno ENOENT if
+// there is no such mailbox; a crash before the rename is on disk only leaves
+// the mailbox at the old place, where it is found again
+static int migrateMailbox(const string &user) {
+    // a LOGIN name is whatever the backend accepts, it must not move a shard
+    if (isShard(user)) {
+        errno = ENOENT;
+        return -1;
+    }
+    string legacy = MAILBOX_ROOT + user;
+    // a mailbox from before the index gets an empty one, just for the lock
+    int fd = open((legacy + "/" MAILBOX_INDEX).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    if (flock(fd, LOCK_EX) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    int rc = 0;
+    if (indexInPlace(legacy, fd)) {
+        string dir = mailboxDir(user);
+        rc = makeShard(dir);
+        if (rc == 0) {
+            rc = rename(legacy.c_str(), dir.c_str());
+        }
+        if (rc == 0) {
+            printf("Moved mailbox %s to %s\n", legacy.c_str(), dir.c_str());
+        } else {
+            perror(("move mailbox " + legacy).c_str());
+            errno = EIO;
+        }
+    }
+    close(fd);
+    return rc;
+}
+
+// openIndex() of user's mailbox, moved to its shard first if it is still at
+// the old place; dir is where it is
+static int openMailbox(const string &user, int lock, indexHeader &header, string &dir) {
+    dir = mailboxDir(user);
+    int fd = openIndex(dir, lock, header);
+    if (fd == -1 && errno == ENOENT && migrateMailbox(user) == 0) {
+        fd = openIndex(dir, lock, header);
+    }
+    return fd;
+}
+
+// the mailbox directory of user exists afterwards, -1 on error
+static int makeMailbox(const string &user) {
+    string dir = mailboxDir(user);
+    struct stat dirStat;
+    if (stat(dir.c_str(), &dirStat) == 0) {
+        return 0;
+    }
+    // one at the old place must not get an empty twin
+    if (migrateMailbox(user) == 0) {
+        return 0;
+    }
+    if (errno != ENOENT || makeShard(dir) == -1 || (mkdir(dir.c_str(), 0777) == -1 && errno != EEXIST)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int mapIndex(int fd, const indexHeader &header, bool writable, indexMap &map) {
+    map.length = sizeof(indexHeader) + header.count * sizeof(mailRecord);
+    void *mem = mmap(NULL, map.length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap index");
+        return -1;
+    }
+    map.base = (char *)mem;
+    return 0;
+}
+
+static void unmapIndex(indexMap &map) {
+    munmap(map.base, map.length);
+    map.base = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// appends entries to the active segment of a mailbox (header.segment) and
+// moves on to the next segment when one would grow beyond SEGMENT_MAX
+// used with the index locked exclusively, the caller writes the header
+struct segmentAppender {
+    const string &dir;
+    indexHeader &header;
+    bool durable = false; // fdatasync a segment before closing it
+    int fd = -1;
+    off_t end = 0;
+
+    segmentAppender(const string &dir, indexHeader &header) : dir(dir), header(header) {}
+    ~segmentAppender() { finish(); }
+
+    // active segment with room for length more bytes, -1 on error
+    int reserve(size_t length) {
+        while (true) {
+            if (fd == -1) {
+                fd = open(segmentPath(dir, header.segment).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+                struct stat fileStat;
+                if (fd == -1 || fstat(fd, &fileStat) == -1) {
+                    finish();
+                    return -1;
+                }
+                end = fileStat.st_size;
+            }
+            // an entry larger than a segment gets one of its own
+            if (end == 0 || end + length <= SEGMENT_MAX) {
+                return 0;
+            }
+            if (finish() == -1) {
+                return -1;
+            }
+            header.segment++;
+        }
+    }
+
+    // entry followed by iov (entry.length bytes), offset = where iov landed
+    int append(const segmentEntry &entry, const struct iovec *iov, int count, uint64_t &offset) {
+        if (reserve(sizeof(entry) + entry.length) == -1) {
+            return -1;
+        }
+        struct iovec all[4] = {{(void *)&entry, sizeof(entry)}};
+        copy_n(iov, min(count, 3), all + 1);
+        if (writeVector(fd, all, min(count, 3) + 1, end) == -1) {
+            ftruncate(fd, end); // no half entries
+            return -1;
+        }
+        offset = end + sizeof(entry);
+        end += sizeof(entry) + entry.length;
+        return 0;
+    }
+
+    // entry followed by entry.length bytes of from at fromOffset
+    int copy(const segmentEntry &entry, int from, off_t fromOffset, uint64_t &offset) {
+        if (reserve(sizeof(entry) + entry.length) == -1 || writeAll(fd, &entry, sizeof(entry), end) == -1) {
+            return -1;
+        }
+        loff_t in = fromOffset;
+        loff_t out = end + sizeof(entry);
+        size_t left = entry.length;
+        while (left > 0) {
+            // https://man7.org/linux/man-pages/man2/copy_file_range.2.html
+            ssize_t n = copy_file_range(from, &in, fd, &out, left, 0);
+            if (n <= 0) {
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (n == 0) {
+                    errno = EIO; // the source is shorter than its record
+                }
+                ftruncate(fd, end);
+                return -1;
+            }
+            left -= n;
+        }
+        offset = end + sizeof(entry);
+        end += sizeof(entry) + entry.length;
+        return 0;
+    }
+
+    int finish() {
+        int rc = 0;
+        if (fd != -1) {
+            if (durable && fdatasync(fd) == -1) {
+                rc = -1;
+            }
+            close(fd);
+            fd = -1;
+        }
+        return rc;
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// makes what this process wrote to fd (and with SYNC_GROUP everything else
+// of the spool) durable, -1 on error
+static int syncStep(int fd) {
+    if (syncMode == SYNC_GROUP) {
+        return groupCommit(fd);
+    }
+    if (syncMode == SYNC_EACH) {
+        return fdatasync(fd);
+    }
+    return 0;
+}
+
+// the message as a new file in <dir>/tmp (maildir style), durable before it
+// gets its name, so an <id>.msg is never torn; -1 on error
+static int writeTemporary(const string &dir, const string &head, const string &message, string &path) {
+    static atomic<unsigned> counter;
+    path = dir + "/" MAILBOX_TMP "/" + to_string(getpid()) + "." + to_string(counter++);
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1 && errno == ENOENT) {
+        mkdir((dir + "/" MAILBOX_TMP).c_str(), 0777);
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    }
+    if (fd == -1) {
+        perror("create message");
+        return -1;
+    }
+    struct iovec iov[2] = {{(void *)head.data(), head.size()}, {(void *)message.data(), message.size()}};
+    int rc = writeVector(fd, iov, 2, 0);
+    if (rc == -1) {
+        perror("write message");
+    } else if ((rc = syncStep(fd)) == -1) {
+        perror("sync message");
+    }
+    close(fd);
+    if (rc == -1) {
+        unlink(path.c_str());
+    }
+    return rc;
+}
+
+// appends the message to the active segment, durable before its record is
+// written; -1 on error
+static int appendMessage(const string &dir, indexHeader &header, mailRecord &record, const string &head,
+                         const string &message) {
+    segmentAppender segment(dir, header);
+    segmentEntry entry = {SEGMENT_MAGIC, SEGMENT_MESSAGE, record.id, record.size, 0};
+    struct iovec iov[2] = {{(void *)head.data(), head.size()}, {(void *)message.data(), message.size()}};
+    if (segment.append(entry, iov, 2, record.offset) == -1) {
+        perror("append message");
+        return -1;
+    }
+    if (syncStep(segment.fd) == -1) {
+        perror("sync segment");
+        return -1; // the bytes are dead, compaction takes them
+    }
+    record.storage = STORAGE_SEGMENTS;
+    record.segment = header.segment;
+    return 0;
+}
+
+// one receiver: the message gets its name there (a link to temporary) or is
+// appended to a segment, then its record; -1 on error
+static int deliverTo(const string &dir, const string &temporary, const string &sender, const string &subject,
+                     const string &head, const string &message) {
+    indexHeader header;
+    int fd = openIndex(dir, LOCK_EX, header);
+    if (fd == -1) {
+        perror("open index");
+        return -1;
+    }
+
+    mailRecord record;
+    fillRecord(record, header.nextId, sender, subject, head.size() + message.size(), time(NULL));
+    int rc = 0;
+    if (!temporary.empty()) {
+        // every receiver links the same file, DEL removes one link
+        rc = link(temporary.c_str(), messagePath(dir, record.id).c_str());
+        if (rc == -1) {
+            perror("link message");
+        }
+    } else {
+        rc = appendMessage(dir, header, record, head, message);
+    }
+
+    // append its record
+    if (rc == 0) {
+        rc = writeAll(fd, &record, sizeof(record), sizeof(header) + header.count * sizeof(mailRecord));
+        if (rc == 0) {
+            header.count++;
+            header.nextId++;
+            rc = writeAll(fd, &header, sizeof(header), 0);
+        }
+        if (rc == -1 && record.storage == STORAGE_FILES) {
+            unlink(messagePath(dir, record.id).c_str());
+        }
+    }
+
+    // others may use the mailbox while it is synced
+    flock(fd, LOCK_UN);
+    if (rc == 0 && syncMode == SYNC_EACH) {
+        if (record.storage == STORAGE_FILES) {
+            int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dirFd == -1 || fsync(dirFd) == -1) {
+                rc = -1;
+            }
+            if (dirFd != -1) {
+                close(dirFd);
+            }
+        }
+        if (rc == 0 && fdatasync(fd) == -1) {
+            rc = -1;
+        }
+    }
+    close(fd);
+    return rc;
+}
+
+int mailboxDeliver(const string &sender, const vector<string> &receivers, const string &subject,
+                   const string &message) {
+    commitScope delivering;
+
+    // 1. check if receivers have folders, if not -> create
+    string receiverList;
+    for (size_t i = 0; i < receivers.size(); i++) {
+        if (makeMailbox(receivers[i]) == -1) {
+            perror("mkdir");
+            return -1;
+        }
+        receiverList += (i > 0 ? "," : "") + receivers[i];
+    }
+
+    // 2. sender, receivers, subject and message are on disk first and only
+    // once, a crash before the records only leaves bytes nobody lists
+    // (a message to several receivers is a file in segment storage as well)
+    string head = sender + "\n" + receiverList + "\n" + subject + "\n";
+    string temporary;
+    if ((mailboxStorage == STORAGE_FILES || receivers.size() > 1) &&
+        writeTemporary(mailboxDir(receivers[0]), head, message, temporary) == -1) {
+        return -1;
+    }
+
+    // 3. every receiver gets a name for it and a record
+    int rc = 0;
+    for (size_t i = 0; i < receivers.size(); i++) {
+        if (deliverTo(mailboxDir(receivers[i]), temporary, sender, subject, head, message) == -1) {
+            fprintf(stderr, "delivery to %s failed\n", receivers[i].c_str());
+            rc = -1;
+        }
+    }
+    if (!temporary.empty()) {
+        unlink(temporary.c_str());
+    }
+
+    // 4. names and records are durable before the OK (SYNC_EACH: done per mailbox)
+    if (syncMode == SYNC_GROUP) {
+        int rootFd = open(MAILBOX_ROOT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (rootFd == -1 || groupCommit(rootFd) == -1) {
+            perror("sync deliveries");
+            rc = -1;
+        }
+        if (rootFd != -1) {
+            close(rootFd);
+        }
+    }
+    return rc;
+}
+
+int mailboxList(const string &user, uint64_t first, size_t max, vector<mailRecord> &records) {
+    string dir;
+    indexHeader header;
+    int fd = openMailbox(user, LOCK_SH, header, dir);
+    if (fd == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    int rc = 0;
+    if (first < header.count) {
+        indexMap map;
+        if (mapIndex(fd, header, false, map) == 0) {
+            size_t count = min((uint64_t)max, header.count - first);
+            records.insert(records.end(), map.records() + first, map.records() + first + count);
+            unmapIndex(map);
+        } else {
+            rc = -1;
+        }
+    }
+    close(fd);
+    return rc;
+}
+
+int mailboxOpen(const string &user, uint64_t nr, off_t &offset, size_t &length) {
+    string dir;
+    indexHeader header;
+    int fd = openMailbox(user, LOCK_SH, header, dir);
+    if (fd == -1) {
+        return -1;
+    }
+
+    // opened under the lock, a DEL can't remove it in between
+    int messageFd = -1;
+    indexMap map;
+    if (nr < header.count && mapIndex(fd, header, false, map) == 0) {
+        mailRecord record = map.records()[nr];
+        unmapIndex(map);
+
+        string path = messagePath(dir, record.id);
+        offset = 0;
+        if (record.storage == STORAGE_SEGMENTS) {
+            path = segmentPath(dir, record.segment);
+            offset = record.offset;
+        }
+        length = record.size;
+        messageFd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (messageFd == -1) {
+            perror(path.c_str());
+        }
+    }
+    close(fd);
+    return messageFd;
+}
+
+int mailboxDelete(const string &user, uint64_t nr) {
+    string dir;
+    indexHeader header;
+    int fd = openMailbox(user, LOCK_EX, header, dir);
+    if (fd == -1) {
+        return -1;
+    }
+
+    indexMap map;
+    if (nr >= header.count || mapIndex(fd, header, true, map) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // the record goes first, a crash before the unlink only leaves an unlisted file
+    mailRecord record = map.records()[nr];
+    memmove(map.records() + nr, map.records() + nr + 1, (header.count - nr - 1) * sizeof(mailRecord));
+    header.count--;
+
+    // segment bytes stay until compaction, the tombstone tells anyone reading
+    // the segments alone that the message is gone
+    if (record.storage == STORAGE_SEGMENTS) {
+        segmentAppender segment(dir, header);
+        segmentEntry tombstone = {SEGMENT_MAGIC, SEGMENT_TOMBSTONE, record.id, 0, 0};
+        uint64_t offset;
+        if (segment.append(tombstone, NULL, 0, offset) == -1) {
+            perror("append tombstone");
+        }
+    }
+    memcpy(map.header(), &header, sizeof(header));
+    unmapIndex(map);
+
+    if (ftruncate(fd, sizeof(header) + header.count * sizeof(mailRecord)) == -1) {
+        perror("truncate index");
+    }
+    if (record.storage == STORAGE_FILES && unlink(messagePath(dir, record.id).c_str()) == -1) {
+        perror("delete message");
+    }
+    close(fd);
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// segment number -> size of every <n>.seg file in dir
+static void listSegments(const string &dir, map<uint64_t, off_t> &segments) {
+    DIR *directoryPointer = opendir(dir.c_str());
+    if (directoryPointer == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(directoryPointer)) != NULL) {
+        char *end;
+        uint64_t segment = strtoull(entry->d_name, &end, 10);
+        struct stat fileStat;
+        if (end != entry->d_name && strcmp(end, ".seg") == 0 &&
+            stat(segmentPath(dir, segment).c_str(), &fileStat) == 0) {
+            segments[segment] = fileStat.st_size;
+        }
+    }
+    closedir(directoryPointer);
+}
+
+// copies the live messages out of mostly dead segments and removes those,
+// returns the bytes given back, -1 on error
+static off_t compactMailbox(const string &dir) {
+    // only mailboxes that have an index, the compactor doesn't adopt any
+    if (access((dir + "/" MAILBOX_INDEX).c_str(), F_OK) == -1) {
+        return 0;
+    }
+    indexHeader header;
+    int fd = openIndex(dir, LOCK_EX, header);
+    if (fd == -1) {
+        return -1;
+    }
+    indexMap map;
+    if (header.count > 0 && mapIndex(fd, header, true, map) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // live bytes per segment, the index is what counts
+    std::map<uint64_t, off_t> live;
+    for (uint64_t i = 0; i < header.count; i++) {
+        const mailRecord &record = map.records()[i];
+        if (record.storage == STORAGE_SEGMENTS) {
+            live[record.segment] += sizeof(segmentEntry) + record.size;
+        }
+    }
+    // plain file mailboxes are not listed
+    std::map<uint64_t, off_t> segments;
+    if (!live.empty() || access(segmentPath(dir, header.segment).c_str(), F_OK) == 0) {
+        listSegments(dir, segments);
+    }
+
+    auto mostlyDead = [&](uint64_t segment) {
+        off_t size = segments[segment];
+        return (size - live[segment]) * 100 > size * COMPACT_DEAD_PERCENT;
+    };
+    // a mostly dead active segment is closed first so it can go as well
+    if (segments.count(header.segment) && mostlyDead(header.segment)) {
+        header.segment++;
+    }
+    set<uint64_t> drop;
+    off_t reclaimed = 0;
+    for (auto &[segment, size] : segments) {
+        if (segment < header.segment && (live[segment] == 0 || mostlyDead(segment))) {
+            drop.insert(segment);
+            reclaimed += size - live[segment];
+        }
+    }
+
+    // survivors keep their order, reading a mailbox stays sequential
+    int rc = 0;
+    segmentAppender out(dir, header);
+    out.durable = true;
+    std::map<uint64_t, int> sources;
+    for (uint64_t i = 0; i < header.count && rc == 0; i++) {
+        mailRecord &record = map.records()[i];
+        if (record.storage != STORAGE_SEGMENTS || !drop.count(record.segment)) {
+            continue;
+        }
+        if (!sources.count(record.segment)) {
+            sources[record.segment] = open(segmentPath(dir, record.segment).c_str(), O_RDONLY | O_CLOEXEC);
+        }
+        segmentEntry entry = {SEGMENT_MAGIC, SEGMENT_MESSAGE, record.id, record.size, 0};
+        uint64_t offset;
+        if (sources[record.segment] == -1 || out.copy(entry, sources[record.segment], record.offset, offset) == -1) {
+            perror("compact");
+            rc = -1;
+            break;
+        }
+        record.segment = header.segment;
+        record.offset = offset;
+    }
+    for (auto &[segment, source] : sources) {
+        if (source != -1) {
+            close(source);
+        }
+    }
+
+    // copies and records must be on disk before the originals go
+    if (out.finish() == -1) {
+        rc = -1;
+    }
+    if (header.count > 0) {
+        if (msync(map.base, map.length, MS_SYNC) == -1) {
+            rc = -1;
+        }
+        unmapIndex(map);
+    }
+    if (writeAll(fd, &header, sizeof(header), 0) == -1 || fdatasync(fd) == -1) {
+        rc = -1;
+    }
+    if (rc == 0) {
+        for (uint64_t segment : drop) {
+            if (unlink(segmentPath(dir, segment).c_str()) == -1) {
+                perror("remove segment");
+            }
+        }
+    }
+    close(fd);
+    return rc == 0 ? reclaimed : -1;
+}
+
+// files of deliveries that never finished
+static void cleanTemporary(const string &dir) {
+    string path = dir + "/" MAILBOX_TMP;
+    DIR *directoryPointer = opendir(path.c_str());
+    if (directoryPointer == NULL) {
+        return;
+    }
+    time_t now = time(NULL);
+    struct dirent *entry;
+    while ((entry = readdir(directoryPointer)) != NULL) {
+        string file = path + "/" + entry->d_name;
+        struct stat fileStat;
+        if (entry->d_type == DT_REG && stat(file.c_str(), &fileStat) == 0 && now - fileStat.st_mtime > TMP_MAX_AGE) {
+            printf("Removing left over %s\n", file.c_str());
+            unlink(file.c_str());
+        }
+    }
+    closedir(directoryPointer);
+}
+
+// housekeeping of one mailbox directory
+static void compactUser(const string &dir, const string &user) {
+    cleanTemporary(dir);
+    off_t reclaimed = compactMailbox(dir);
+    if (reclaimed == -1) {
+        fprintf(stderr, "compacting %s failed\n", user.c_str());
+    } else if (reclaimed > 0) {
+        printf("Compacted %s, %lld bytes reclaimed\n", user.c_str(), (long long)reclaimed);
+    }
+}
+
+// names of the directories in path
+static void listDirectories(const string &path, vector<string> &names) {
+    DIR *directoryPointer = opendir(path.c_str());
+    if (directoryPointer == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(directoryPointer)) != NULL) {
+        if (entry->d_type == DT_DIR && entry->d_name[0] != '.') {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(directoryPointer);
+}
+
+int mailboxMigrateAll() {
+    vector<string> names;
+    listDirectories(MAILBOX_ROOT, names);
+
+    int moved = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+        if (isShard(names[i])) {
+            continue;
+        }
+        if (migrateMailbox(names[i]) == -1) {
+            fprintf(stderr, "moving %s failed\n", names[i].c_str());
+        } else {
+            moved++;
+        }
+    }
+    return moved;
+}
+
+void mailboxCompactAll() {
+    mailboxMigrateAll();
+
+    vector<string> shards;
+    listDirectories(MAILBOX_ROOT, shards);
+    for (size_t i = 0; i < shards.size(); i++) {
+        if (!isShard(shards[i])) {
+            continue;
+        }
+        vector<string> subShards;
+        listDirectories(MAILBOX_ROOT + shards[i], subShards);
+        for (size_t j = 0; j < subShards.size(); j++) {
+            string shard = MAILBOX_ROOT + shards[i] + "/" + subShards[j];
+            vector<string> users;
+            listDirectories(shard, users);
+            for (size_t k = 0; k < users.size(); k++) {
+                compactUser(shard + "/" + users[k], users[k]);
+            }
+        }
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define MAILBOX_ROOT "../mail-spooler/"
+#define MAILBOX_INDEX ".index"
+#define MAILBOX_TMP "tmp" // deliveries in progress, see mailboxDeliver()
+
+#define MAIL_SENDER_MAX 16
+#define MAIL_SUBJECT_MAX 68
+
+// where SEND stores new messages (--storage)
+#define STORAGE_FILES 0    // one file <id>.msg per message
+#define STORAGE_SEGMENTS 1 // appended to <n>.seg, see below
+
+extern int mailboxStorage;
+
+// one message in the index of a mailbox, fixed size, stored as is
+struct mailRecord {
+    uint64_t id;          // unique per mailbox, never reused
+    int64_t timestamp;    // delivery, seconds since the epoch
+    uint64_t subjectHash; // FNV-1a of the whole subject
+    uint64_t offset;      // STORAGE_SEGMENTS: where the message starts in its segment
+    uint32_t size;        // bytes of the message
+    uint32_t segment;     // STORAGE_SEGMENTS: number of the segment file
+    uint8_t senderLen;
+    uint8_t subjectLen;   // subjects longer than MAIL_SUBJECT_MAX are cut
+    uint8_t storage;      // STORAGE_FILES or STORAGE_SEGMENTS
+    uint8_t reserved;
+    char sender[MAIL_SENDER_MAX];
+    char subject[MAIL_SUBJECT_MAX];
+};
+
+static_assert(sizeof(mailRecord) == 128, "index records are 128 bytes on disk");
+
+// every mailbox directory has a binary index: a header and one record per
+// message in delivery order, so message number N is record N (one array
+// lookup in the mapped file instead of counting readdir() entries)
+// SEND appends a record, DEL removes one and moves the rest up, both under an
+// exclusive flock(); LIST and READ map the index under a shared one
+// mailboxes from before the index get one on first use (their files are
+// renamed to <id>.msg in readdir order)
+
+// with STORAGE_SEGMENTS messages are appended to segment files instead, every
+// one behind a small entry header; a segment is closed at SEGMENT_MAX and the
+// next one started, so a mailbox costs a few inodes instead of one per message
+// DEL appends a tombstone entry, the bytes stay until mailboxCompactAll()
+// copies the live messages of mostly dead segments over and removes them
+// both kinds can be mixed in one mailbox, each record knows where its message is
+
+#define SEGMENT_MAX (8 * 1024 * 1024)
+
+// mailboxes are spread over MAILBOX_ROOT/_<XX>/_<YY>/<user>, XX and YY being
+// the top bytes of a hash of the user name, so no directory on the way gets
+// big, however many users there are (65536 shards)
+// user names are lower case letters and digits, a shard name starts with
+// MAILBOX_SHARD, so a mailbox still at the old place MAILBOX_ROOT/<user> is
+// never taken for a shard nor the other way round; such a mailbox is moved to
+// its shard under the exclusive lock of its index, once it is used or by
+// mailboxMigrateAll(), while the server keeps running
+#define MAILBOX_SHARD "_"
+std::string mailboxDir(const std::string &user);
+
+// SEND: the message is written (and synced, see groupcommit.h) to tmp/ once
+// and linked into every receiver's mailbox as <id>.msg before its record
+// exists, so all receivers share one copy and DEL drops one link; a message
+// to a single receiver is appended and synced to a segment instead with
+// STORAGE_SEGMENTS; records are synced before it returns
+// -1 if any receiver didn't get it (the others keep theirs)
+int mailboxDeliver(const std::string &sender, const std::vector<std::string> &receivers, const std::string &subject,
+                   const std::string &message);
+// appends up to max records starting at message first, -1 on error
+// (a mailbox that doesn't exist is empty)
+int mailboxList(const std::string &user, uint64_t first, size_t max, std::vector<mailRecord> &records);
+// read only descriptor of the file holding message nr, the message is the
+// length bytes at offset; -1 if there is none
+int mailboxOpen(const std::string &user, uint64_t nr, off_t &offset, size_t &length);
+// -1 if there is no message nr
+int mailboxDelete(const std::string &user, uint64_t nr);
+
+// moves every mailbox still at the old place to its shard, returns how many
+int mailboxMigrateAll();
+// housekeeping of every mailbox: moves old ones to their shard, reclaims the
+// space of deleted segment messages and removes files interrupted deliveries
+// left in tmp/
+void mailboxCompactAll();
+
+#endif
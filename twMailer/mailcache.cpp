@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <list>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "mailcache.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// https://man7.org/linux/man-pages/man7/inotify.7.html
+#define MAILBOX_EVENTS \
+    (IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct cacheEntry {
+    shared_ptr<const vector<mailRecord>> records; // NULL while not loaded
+    uint64_t stamp = 0; // changes with every invalidation
+    int wd = -1;        // watch on the mailbox directory
+    list<string>::iterator lru;
+};
+
+static int notifyFd = -1;
+static unordered_map<string, cacheEntry> entries;
+static unordered_map<int, string> watches; // wd -> user
+static list<string> lru;                   // most recently used first
+static size_t cachedRecords = 0;
+static uint64_t nextStamp = 1;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void forget(cacheEntry &entry) {
+    if (entry.records) {
+        cachedRecords -= entry.records->size();
+        entry.records.reset();
+    }
+    entry.stamp = nextStamp++;
+}
+
+static void removeEntry(unordered_map<string, cacheEntry>::iterator it) {
+    cacheEntry &entry = it->second;
+    forget(entry);
+    if (entry.wd != -1) {
+        watches.erase(entry.wd);
+        inotify_rm_watch(notifyFd, entry.wd);
+    }
+    lru.erase(entry.lru);
+    entries.erase(it);
+}
+
+static void invalidateAll() {
+    for (auto &[user, entry] : entries) {
+        forget(entry);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int mailCacheInit() {
+    notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notifyFd == -1) {
+        perror("inotify_init1");
+        return -1;
+    }
+    return notifyFd;
+}
+
+void mailCacheClose() {
+    if (notifyFd == -1) {
+        return;
+    }
+    entries.clear();
+    watches.clear();
+    lru.clear();
+    cachedRecords = 0;
+    close(notifyFd); // removes every watch
+    notifyFd = -1;
+}
+
+void mailCacheEvents() {
+    // https://man7.org/linux/man-pages/man7/inotify.7.html
+    alignas(struct inotify_event) char buffer[16384];
+
+    while (notifyFd != -1) {
+        ssize_t size = read(notifyFd, buffer, sizeof(buffer));
+        if (size == -1 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            return; // EAGAIN, nothing left
+        }
+
+        for (char *p = buffer; p < buffer + size; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *event = (struct inotify_event *)p;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                invalidateAll(); // events were lost
+                continue;
+            }
+
+            auto watch = watches.find(event->wd);
+            if (watch == watches.end()) {
+                continue;
+            }
+            auto it = entries.find(watch->second);
+            if (event->mask & IN_IGNORED) {
+                // the directory is gone, a new one gets a new watch
+                watches.erase(watch);
+                if (it != entries.end()) {
+                    it->second.wd = -1;
+                    forget(it->second);
+                }
+                continue;
+            }
+            // message files change along with the index
+            bool changed = (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) ||
+                           (event->len > 0 && strcmp(event->name, MAILBOX_INDEX) == 0);
+            if (changed && it != entries.end()) {
+                forget(it->second);
+            }
+        }
+    }
+}
+
+shared_ptr<const vector<mailRecord>> mailCacheFind(const string &user) {
+    auto it = entries.find(user);
+    if (it == entries.end() || !it->second.records) {
+        return NULL;
+    }
+    lru.splice(lru.begin(), lru, it->second.lru);
+    return it->second.records;
+}
+
+uint64_t mailCacheBegin(const string &user) {
+    if (notifyFd == -1) {
+        return 0;
+    }
+
+    auto it = entries.find(user);
+    if (it == entries.end()) {
+        // the least recently used one makes room
+        if (entries.size() >= MAIL_CACHE_USERS) {
+            removeEntry(entries.find(lru.back()));
+        }
+        it = entries.emplace(user, cacheEntry()).first;
+        lru.push_front(user);
+        it->second.lru = lru.begin();
+        it->second.stamp = nextStamp++;
+    } else {
+        lru.splice(lru.begin(), lru, it->second.lru);
+    }
+
+    // watched before anything is read, a change after the read can't go unnoticed
+    cacheEntry &entry = it->second;
+    if (entry.wd == -1) {
+        entry.wd = inotify_add_watch(notifyFd, mailboxDir(user).c_str(), MAILBOX_EVENTS);
+        if (entry.wd == -1) {
+            // ENOENT: no mailbox yet (or not in its shard yet), nothing to keep
+            if (errno != ENOENT) {
+                perror("inotify_add_watch");
+            }
+            removeEntry(it);
+            return 0;
+        }
+        watches[entry.wd] = user;
+    }
+    return entry.stamp;
+}
+
+void mailCacheStore(const string &user, uint64_t ticket, vector<mailRecord> records) {
+    auto it = entries.find(user);
+    if (it == entries.end() || it->second.stamp != ticket || it->second.records ||
+        records.size() > MAIL_CACHE_MAILBOX_MAX) {
+        return; // changed while it was read
+    }
+
+    cachedRecords += records.size();
+    it->second.records = make_shared<const vector<mailRecord>>(std::move(records));
+
+    // least recently used ones go until it fits
+    while (cachedRecords > MAIL_CACHE_RECORDS && lru.back() != user) {
+        removeEntry(entries.find(lru.back()));
+    }
+}
+
+void mailCacheInvalidate(const string &user) {
+    auto it = entries.find(user);
+    if (it != entries.end()) {
+        forget(it->second);
+    }
+}
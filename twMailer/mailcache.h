@@ -0,0 +1,42 @@
+#ifndef MAILCACHE_H
+#define MAILCACHE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mailbox.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define MAIL_CACHE_RECORDS 262144    // records cached per process (128 bytes each)
+#define MAIL_CACHE_MAILBOX_MAX 65536 // larger mailboxes are always read from disk
+#define MAIL_CACHE_USERS 4096        // mailboxes cached or being loaded, one watch each
+
+// index records of recently listed mailboxes, kept by the long-lived
+// processes (epoll/uring), so a repeated LIST is answered from memory
+// LIST fills the cache with what it reads anyway; inotify on every cached
+// mailbox drops an entry once its index changes or the mailbox goes away, no
+// matter which process or tool changed it (mailboxes that don't exist aren't
+// cached, the next LIST looks again); the server loop reads the events
+// changes this process makes drop the entry right away (mailCacheInvalidate)
+// all of it runs on the loop thread, blocking steps only read the mailbox
+// least recently used mailboxes go first once the cache is full
+
+// the inotify descriptor the loop watches for POLLIN, -1 = cache off
+int mailCacheInit();
+void mailCacheClose();
+// handles pending inotify events, call when the descriptor is readable
+void mailCacheEvents();
+
+// records of user, NULL if they are not cached
+std::shared_ptr<const std::vector<mailRecord>> mailCacheFind(const std::string &user);
+// before reading a mailbox for the cache: returns a ticket for
+// mailCacheStore(), 0 = don't bother (cache off)
+uint64_t mailCacheBegin(const std::string &user);
+// keeps the complete index read since mailCacheBegin(), unless it changed meanwhile
+void mailCacheStore(const std::string &user, uint64_t ticket, std::vector<mailRecord> records);
+// the mailbox changed or won't be cached
+void mailCacheInvalidate(const std::string &user);
+
+#endif
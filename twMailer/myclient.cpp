@@ -1,6 +1,11 @@
+#include <algorithm>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
 #include <iostream>
+#include <iterator>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +14,8 @@
 #include <unistd.h>
 #include <vector>
 
+#include "protocol.h"
+
 ///////////////////////////////////////////////////////////////////////////////
 
 #define BUF 8192
@@ -51,6 +58,42 @@ std::string receiveUser(std::string role) {
     return input;
 }
 
+// one or more usernames separated by ',', each checked like receiveUser()
+std::string receiveReceivers() {
+    std::string input;
+    bool wrongInput = true;
+
+    while(wrongInput) {
+        std::cout << "Please enter Receivers' usernames, separated by ',' (max. 8 chars, a - z, 0 - 9 each)" << std::endl;
+        std::cout << ">> ";
+        std::getline(std::cin, input);
+
+        wrongInput = false;
+        size_t start = 0;
+        while (!wrongInput) {
+            size_t comma = input.find(',', start);
+            std::string name = input.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+            if (name.empty() || name.size() > 8) {
+                std::cout << "Every username needs 1 to 8 chars. ";
+                wrongInput = true;
+                break;
+            }
+            for (unsigned int i = 0; i < name.length(); i++) {
+                if (!(std::islower(name[i]) || std::isdigit(name[i]))) {
+                    std::cout << "Wrong characters. ";
+                    wrongInput = true;
+                    break;
+                }
+            }
+            if (comma == std::string::npos) {
+                break;
+            }
+            start = comma + 1;
+        }
+    }
+    return input;
+}
+
 std::string receivePassword() {
     std::string input;
     bool wrongInput = true;
@@ -95,7 +138,12 @@ std::string receiveMessage(){
     while(!exitCondition){
         std::cout << ">> ";
         std::getline(std::cin, input);
-        if(input == "." && messageNo != 0){
+        // the server ends the body at the first "." and refuses an empty one
+        if(input == "." && messageNo == 0){
+            std::cout << "Message is empty. ";
+            continue;
+        }
+        if(input == "."){
             exitCondition = true;
         }
         inputs.push_back(input);
@@ -133,12 +181,260 @@ std::string receiveNumber() {
     return input;
 }
 
+// bytes received from the server but not printed yet
+std::string received;
+
+// false if the server closed the connection or recv failed
+bool receiveMore(int create_socket) {
+    char buffer[BUF];
+    ssize_t size = recv(create_socket, buffer, BUF, 0);
+    if (size == -1) {
+        perror("recv error");
+        return false;
+    }
+    if (size == 0) {
+        printf("Server closed remote socket\n"); // ignore error
+        return false;
+    }
+    received.append(buffer, size);
+    return true;
+}
+
+// one line without '\n', false if the connection ended first
+bool receiveLine(int create_socket, std::string &line) {
+    size_t end;
+    while ((end = received.find('\n')) == std::string::npos) {
+        if (!receiveMore(create_socket)) {
+            return false;
+        }
+    }
+    line = received.substr(0, end);
+    received.erase(0, end + 1);
+    return true;
+}
+
+// responses can be much longer than one recv, they are framed:
+//   READ   "OK <bytes>" followed by exactly that many bytes
+//   LIST   "OK", one line per message, "Total message count: <n>"
+//   else   one line
+bool receiveResponse(int create_socket, const std::string &command) {
+    std::string line;
+    if (!receiveLine(create_socket, line)) {
+        return false;
+    }
+    printf("<< %s\n", line.c_str());
+
+    if (command == "READ" && line.compare(0, 3, "OK ") == 0) {
+        size_t length = strtoul(line.c_str() + 3, NULL, 10);
+        while (length > 0) {
+            if (received.empty() && !receiveMore(create_socket)) {
+                return false;
+            }
+            size_t size = std::min(length, received.size());
+            fwrite(received.data(), 1, size, stdout);
+            received.erase(0, size);
+            length -= size;
+        }
+    } else if (command == "LIST" && line == "OK") {
+        do {
+            if (!receiveLine(create_socket, line)) {
+                return false;
+            }
+            printf("%s\n", line.c_str());
+        } while (line.compare(0, 21, "Total message count: ") != 0);
+    }
+    return true;
+}
+
+// the banner up to its "Please enter your commands..." line, printed
+// true in *offered if the server speaks v2, false if the connection ended
+bool receiveBanner(int create_socket, bool *offered) {
+    std::string line;
+    *offered = false;
+    do {
+        if (!receiveLine(create_socket, line)) {
+            return false;
+        }
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        printf("%s\n", line.c_str());
+        if (line == V2_OFFER) {
+            *offered = true;
+        }
+    } while (line.compare(0, 26, "Please enter your commands") != 0);
+    return true;
+}
+
+// the command the text protocol sends as lines, as a v2 frame
+// inputs: the lines without the command itself, a SEND body with its "." line
+std::string v2Request(const std::string &command, const std::vector<std::string> &inputs, uint32_t requestId) {
+    std::vector<std::string> fields(inputs.begin() + (inputs.empty() ? 0 : 1), inputs.end());
+    int type = V2_QUIT;
+    if (command == "LOGIN") {
+        type = V2_LOGIN;
+    } else if (command == "SEND") {
+        type = V2_SEND;
+        // the "." line only ends the body in text mode
+        fields[2].erase(fields[2].size() - 2);
+    } else if (command == "LIST") {
+        type = V2_LIST;
+    } else if (command == "READ" || command == "DEL") {
+        type = command == "READ" ? V2_READ : V2_DEL;
+        unsigned long number = strtoul(fields[0].c_str(), NULL, 10);
+        fields[0] = v2Number(std::min(number, 0xffffffffUL));
+    }
+    std::vector<std::string_view> views(fields.begin(), fields.end());
+    return v2Frame(type, 0, requestId, views);
+}
+
+// one frame, false if the connection ended first
+bool receiveFrame(int create_socket, int &type, int &flags, uint32_t &requestId, std::vector<std::string> &fields) {
+    while (received.size() < V2_HEADER_SIZE) {
+        if (!receiveMore(create_socket)) {
+            return false;
+        }
+    }
+    size_t size = V2_HEADER_SIZE + v2Get32(received.data() + 8);
+    while (received.size() < size) {
+        if (!receiveMore(create_socket)) {
+            return false;
+        }
+    }
+
+    type = (unsigned char)received[0];
+    flags = (unsigned char)received[1];
+    requestId = v2Get32(received.data() + 4);
+    fields.clear();
+    size_t offset = V2_HEADER_SIZE;
+    for (int i = v2Get16(received.data() + 2); i > 0 && offset + 4 <= size; i--) {
+        size_t length = std::min((size_t)v2Get32(received.data() + offset), size - offset - 4);
+        fields.push_back(received.substr(offset + 4, length));
+        offset += 4 + length;
+    }
+    received.erase(0, size);
+    return true;
+}
+
+// prints a v2 response like receiveResponse() prints the text one
+bool receiveResponseV2(int create_socket, const std::string &command, uint32_t requestId) {
+    int type, flags;
+    uint32_t answered;
+    std::vector<std::string> fields;
+    uint64_t msgNr = 0;
+    do {
+        if (!receiveFrame(create_socket, type, flags, answered, fields)) {
+            return false;
+        }
+        if (answered != requestId) {
+            printf("<< response to request %u, expected %u\n", answered, requestId);
+        }
+        if (type != V2_OK) {
+            printf("<< ERR\n");
+            return true;
+        }
+
+        if (command == "READ" && fields.size() == 1) {
+            printf("<< OK %zu\n", fields[0].size());
+            fwrite(fields[0].data(), 1, fields[0].size(), stdout);
+        } else if (command == "LIST") {
+            if (msgNr == 0 && (flags & V2_MORE || fields.size() == 1)) {
+                printf("<< OK\n");
+            }
+            if (flags & V2_MORE) {
+                for (size_t i = 0; i + 1 < fields.size(); i += 2) {
+                    printf("%lu: %s: %s\n", (unsigned long)msgNr++, fields[i].c_str(), fields[i + 1].c_str());
+                }
+            } else if (fields.size() == 1 && fields[0].size() == 4) {
+                printf("Total message count: %u\n", v2Get32(fields[0].data()));
+            }
+        } else {
+            printf("<< OK\n");
+        }
+    } while (flags & V2_MORE);
+    return true;
+}
+
+// pipelined mode: protocol lines from stdin go out back to back without
+// waiting for answers, the answers are printed as they come in
+//   ./client -p 127.0.0.1 < commands.txt
+// the server answers in order and closes the connection after QUIT
+int runPipelined(int create_socket) {
+    std::string request((std::istreambuf_iterator<char>(std::cin)), std::istreambuf_iterator<char>());
+    if (!request.empty() && request.back() != '\n') {
+        request += '\n';
+    }
+    if (request.size() < 5 || request.compare(request.size() - 5, 5, "QUIT\n") != 0) {
+        request += "QUIT\n";
+    }
+
+    char buffer[BUF];
+    size_t sent = 0;
+
+    // send and receive at the same time, else both sides could block on full buffers
+    while (true) {
+        struct pollfd pfd;
+        pfd.fd = create_socket;
+        pfd.events = POLLIN;
+        if (sent < request.size()) {
+            pfd.events |= POLLOUT;
+        }
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll error");
+            return -1;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = send(create_socket, request.data() + sent, request.size() - sent,
+                             MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("send error");
+                return -1;
+            }
+            if (n > 0) {
+                sent += n;
+            }
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t size = recv(create_socket, buffer, BUF, 0);
+            if (size == -1) {
+                perror("recv error");
+                return -1;
+            }
+            if (size == 0) {
+                return 0; // server closed after QUIT
+            }
+            fwrite(buffer, 1, size, stdout);
+        }
+    }
+}
+
 int main(int argc, char **argv){
     int create_socket;
-    char buffer[BUF];
     struct sockaddr_in address;
-    int size;
     int isQuit = 0;
+    bool pipelined = false;
+    bool textOnly = false;
+    bool v2 = false;
+    uint32_t requestId = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "pt")) != -1) {
+        if (opt == 'p') {
+            pipelined = true;
+        } else if (opt == 't') {
+            textOnly = true;
+        } else {
+            fprintf(stderr, "Usage: %s [-p] [-t] [server ip]\n", argv[0]);
+            fprintf(stderr, "  -p  send protocol lines from stdin without waiting for answers\n");
+            fprintf(stderr, "  -t  stay with the text protocol even if the server offers v2\n");
+            return EXIT_FAILURE;
+        }
+    }
 
     ////////////////////////////////////////////////////////////////////////////
     // CREATE A SOCKET
@@ -152,10 +448,10 @@ int main(int argc, char **argv){
     memset(&address, 0, sizeof(address)); // init storage with 0
     address.sin_family = AF_INET;         // IPv4
     address.sin_port = htons(PORT);
-    if (argc < 2) {
+    if (optind >= argc) {
         inet_aton("127.0.0.1", &address.sin_addr);
     } else {
-        inet_aton(argv[1], &address.sin_addr);
+        inet_aton(argv[optind], &address.sin_addr);
     }
 
     ////////////////////////////////////////////////////////////////////////////
@@ -170,25 +466,34 @@ int main(int argc, char **argv){
 
     ////////////////////////////////////////////////////////////////////////////
     // RECEIVE DATA
-    size = recv(create_socket, buffer, BUF - 1, 0);
-    if (size == -1) {
-        perror("recv error");
-    } else if (size == 0) {
-        printf("Server closed remote socket\n"); // ignore error
-    } else {
-        buffer[size] = '\0';
-        printf("%s", buffer); // ignore error
+    // pipelined mode sends text lines as they are, everybody else switches to
+    // v2 when the server offers it (an older one doesn't, then text it is)
+    bool offered = false;
+    if (!receiveBanner(create_socket, &offered)) {
+        isQuit = 1;
+    } else if (offered && !textOnly && !pipelined) {
+        std::string line;
+        if (send(create_socket, "V2\n", 3, 0) == 3 && receiveLine(create_socket, line) && line == "OK") {
+            v2 = true;
+            printf("Using protocol v2\n");
+        }
     }
 
     int inputCorrect = 0;
     std::string input;
+    std::string request;
     std::vector<std::string> inputs;
 
     ////////////////////////////////////////////////////////////////////////////
     // HANDLE INPUT
 
-    //do-loop handles input and receives answer until exit condition (quit)
-    do{
+    if (pipelined) {
+        runPipelined(create_socket);
+        isQuit = 1;
+    }
+
+    //loop handles input and receives answer until exit condition (quit)
+    while (!isQuit) {
         while(inputCorrect == 0){
             input = receiveInput();
 
@@ -209,9 +514,8 @@ int main(int argc, char **argv){
                     input += '\n';
                 }
 
-                strcpy(buffer, input.c_str());
-                size = strlen(buffer);
-                buffer[size - 1] = '\0';
+                // every line ends with '\n', the server frames commands by lines
+                request = input;
                 input.erase();
 
                 inputCorrect++;
@@ -220,7 +524,7 @@ int main(int argc, char **argv){
                 inputs.push_back(input);
                 input.erase();
 
-                input = receiveUser("Receiver's ");
+                input = receiveReceivers();
                 inputs.push_back(input);
                 input.erase();
 
@@ -243,9 +547,7 @@ int main(int argc, char **argv){
                 iter--;
                 input.erase(iter);
 
-                //transforming c++ std::string input into c-array char[] buffer
-                strcpy(buffer, input.c_str());
-                size = strlen(buffer);
+                request = input;
                 input.erase();
 
                 inputCorrect++;
@@ -260,9 +562,7 @@ int main(int argc, char **argv){
                     input += '\n';
                 }
 
-                //transforming c++ std::string input into c-array char[] buffer
-                strcpy(buffer, input.c_str());
-                size = strlen(buffer);
+                request = input;
                 input.erase();
 
                 inputCorrect++;
@@ -281,10 +581,8 @@ int main(int argc, char **argv){
                     input += '\n';
                 }
 
-                //transforming c++ std::string input into c-array char[] buffer
-                strcpy(buffer, input.c_str());
-                size = strlen(buffer);
-                buffer[size - 1] = '\0';
+                // every line ends with '\n', the server frames commands by lines
+                request = input;
                 input.erase();
 
                 inputCorrect++;
@@ -303,14 +601,13 @@ int main(int argc, char **argv){
                     input += '\n';
                 }
 
-                //transforming c++ std::string input into c-array char[] buffer
-                strcpy(buffer, input.c_str());
-                size = strlen(buffer);
+                request = input;
                 input.erase();
 
                 inputCorrect++;
             }
             else if(input == "QUIT" || input == "quit"){
+                request = "QUIT\n";
                 isQuit++;
                 inputCorrect++;
             }
@@ -320,9 +617,23 @@ int main(int argc, char **argv){
         }
         inputCorrect = 0;
 
+        std::string command = request.substr(0, request.find('\n'));
+        if (v2) {
+            request = v2Request(command, inputs, ++requestId);
+        }
+
         //////////////////////////////////////////////////////////////////////
         // SEND DATA
-        if ((send(create_socket, buffer, size, 0)) == -1) {
+        // a SEND can be larger than one send() call takes
+        size_t sent = 0;
+        while (sent < request.size()) {
+            ssize_t n = send(create_socket, request.data() + sent, request.size() - sent, 0);
+            if (n == -1) {
+                break;
+            }
+            sent += n;
+        }
+        if (sent < request.size()) {
             perror("send error");
             break;
         }
@@ -330,22 +641,14 @@ int main(int argc, char **argv){
         //////////////////////////////////////////////////////////////////////
         // CLEAR BUFFERS
         inputs.clear();
-        strcpy(buffer, "");
+        request.clear();
 
         //////////////////////////////////////////////////////////////////////
         // RECEIVE FEEDBACK
-        size = recv(create_socket, buffer, BUF - 1, 0);
-        if (size == -1) {
-            perror("recv error");
+        if (!(v2 ? receiveResponseV2(create_socket, command, requestId) : receiveResponse(create_socket, command))) {
             break;
-        } else if (size == 0) {
-            printf("Server closed remote socket\n"); // ignore error
-            break;
-        } else {
-            buffer[size] = '\0';
-            printf("<< %s\n", buffer); // ignore error
         }
-    } while (!isQuit);
+    }
 
     ////////////////////////////////////////////////////////////////////////////
     // CLOSES THE DESCRIPTOR
@@ -1,5 +1,6 @@
 #include <arpa/inet.h>
 #include <iostream>
+#include <map>
 #include <netinet/in.h>
 #include <signal.h>
 #include <stdio.h>
@@ -10,26 +11,42 @@
 #include <unistd.h>
 #include <vector>
 
-// directory management
-#include <dirent.h>
-#include <sys/stat.h>
-#include <sys/types.h>
+// command line
+#include <getopt.h>
 
-// files
-#include <fstream>
+// event loop modes
+#include <errno.h>
+#include <sys/resource.h>
 
-//ldap
-#include <ldap.h>
+// worker processes
+#include <sched.h>
 
 //threading
 #include <sys/wait.h>
 
+#include "attempts.h"
+#include "auth.h"
+#include "bindcache.h"
+#include "blacklist.h"
+#include "credstore.h"
+#include "diskpool.h"
+#include "groupcommit.h"
+#include "ldappool.h"
+#include "mailbox.h"
+#include "ratelimit.h"
+#include "server.h"
+#include "session.h"
+
 using namespace std;
 
 ///////////////////////////////////////////////////////////////////////////////
 
-#define BUF 8192
 #define PORT 6543
+#define MAX_CHILDREN 256
+#define MAX_WORKERS 64
+#define LISTEN_BACKLOG SOMAXCONN
+// seconds between two compactor runs
+#define COMPACT_INTERVAL 60
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -42,26 +59,237 @@ int new_socket = -1;
 struct comm_args{
     int socket;
     string clientIP;
-    int* loginAttempt;
 };
 
 //take care of future child processes
 int childCount = 0;
-pid_t child_pids[256];
+pid_t child_pids[MAX_CHILDREN];
+
+//worker processes (--workers), only known to the parent
+int workerCount = 0;
+pid_t worker_pids[MAX_WORKERS];
+
+//mailbox compactor process, only known to the parent
+pid_t compactorPid = -1;
 
 ///////////////////////////////////////////////////////////////////////////////
 
+int createListener();
+void startCompactor();
+void stopCompactor();
+int serve(const string &mode);
+void forkLoop();
 void clientCommunication(comm_args args);
 void signalHandler(int sig);
 
 ///////////////////////////////////////////////////////////////////////////////
 
-int main(void) {
-    socklen_t addrlen;
-    struct sockaddr_in address, cliaddress;
-    int reuseValue = 1;
-    string clientIP;
-    int loginAttempt = 0;
+void printUsage(const char *program) {
+    fprintf(stderr, "Usage: %s [--mode fork|epoll|uring] [--workers N] [--auth ldap|local] [--ldap URI]\n"
+                    "          [--ldap-pool N] [--ldap-timeout S] [--bind-cache-ttl S] [--storage files|segments]\n"
+                    "          [--sync off|each|group] [--commit-window US] [--disk-threads N] [--disk-stats S]\n"
+                    "          [--ban-seconds S] [--ip-rate R[/B]] [--user-rate R[/B]] [--migrate-spool]\n"
+                    "          [--add-credential USER]\n",
+            program);
+    fprintf(stderr, "  --mode fork   one child process per connection (default)\n");
+    fprintf(stderr, "  --mode epoll  all connections in one process, edge-triggered epoll\n");
+    fprintf(stderr, "  --mode uring  all connections in one process, io_uring\n");
+    fprintf(stderr, "  --workers N   N worker processes pinned to cores, each with its own\n");
+    fprintf(stderr, "                SO_REUSEPORT listener running the chosen mode (default 1)\n");
+    fprintf(stderr, "  --auth ldap   LOGIN binds against the directory (default)\n");
+    fprintf(stderr, "  --auth local  LOGIN checks the local credential database %s\n", CRED_FILE);
+    fprintf(stderr, "  --ldap URI    directory to authenticate against (default %s)\n", LDAP_DEFAULT_URI);
+    fprintf(stderr, "  --ldap-pool N TLS connections each epoll/uring process opens ahead, in the\n");
+    fprintf(stderr, "                background from its first LOGIN on (default %d)\n", LDAP_DEFAULT_POOL);
+    fprintf(stderr, "  --ldap-timeout S\n");
+    fprintf(stderr, "                seconds the directory has to answer a LOGIN (default %d)\n", LDAP_DEFAULT_TIMEOUT);
+    fprintf(stderr, "  --bind-cache-ttl S\n");
+    fprintf(stderr, "                seconds a successful LOGIN is answered without the directory,\n");
+    fprintf(stderr, "                0 = always ask it (default %d)\n", BIND_CACHE_DEFAULT_TTL);
+    fprintf(stderr, "  --storage files     SEND stores one file per message (default)\n");
+    fprintf(stderr, "  --storage segments  SEND appends to per-user segment files, a background\n");
+    fprintf(stderr, "                      process reclaims deleted messages every %ds\n", COMPACT_INTERVAL);
+    fprintf(stderr, "  --sync off    SEND answers OK without waiting for the disk\n");
+    fprintf(stderr, "  --sync each   SEND syncs every file it wrote before answering OK\n");
+    fprintf(stderr, "  --sync group  concurrent SENDs share one sync of the spool (default)\n");
+    fprintf(stderr, "  --commit-window US\n");
+    fprintf(stderr, "                microseconds a group sync waits for SENDs still writing (default %d)\n",
+            COMMIT_DEFAULT_WINDOW);
+    fprintf(stderr, "  --disk-threads N\n");
+    fprintf(stderr, "                threads each epoll/uring process runs disk and directory work on,\n");
+    fprintf(stderr, "                0 = on the loop thread (default %d)\n", DISK_DEFAULT_THREADS);
+    fprintf(stderr, "  --disk-stats S\n");
+    fprintf(stderr, "                print queue depth and latency of the disk work every S seconds\n");
+    fprintf(stderr, "  --ban-seconds S\n");
+    fprintf(stderr, "                how long an address is banned after 3 failed LOGINs (default %d)\n",
+            BLACKLIST_DEFAULT_BAN);
+    fprintf(stderr, "  --ip-rate R[/B]\n");
+    fprintf(stderr, "                connections and LOGINs per second an address may make, in bursts of\n");
+    fprintf(stderr, "                up to B, 0 = no limit (default %d/%d)\n", RATE_DEFAULT_IP, RATE_DEFAULT_IP_BURST);
+    fprintf(stderr, "  --user-rate R[/B]\n");
+    fprintf(stderr, "                SENDs and READs per second a user may make, in bursts of up to B,\n");
+    fprintf(stderr, "                0 = no limit (default %d/%d)\n", RATE_DEFAULT_USER, RATE_DEFAULT_USER_BURST);
+    fprintf(stderr, "  --migrate-spool\n");
+    fprintf(stderr, "                move every mailbox of the old flat spool layout to its shard and\n");
+    fprintf(stderr, "                exit, running servers may go on meanwhile\n");
+    fprintf(stderr, "  --add-credential USER\n");
+    fprintf(stderr, "                set USER's password in the local credential database to the\n");
+    fprintf(stderr, "                first line of stdin and exit, running servers pick it up\n");
+}
+
+// "R" or "R/B", a burst left out is 10 seconds worth of the rate
+static bool parseRate(const char *text, int &rate, int &burst) {
+    int fields = sscanf(text, "%d/%d", &rate, &burst);
+    if (fields == 1) {
+        burst = max(rate * 10, 1);
+    }
+    return fields >= 1 && rate >= 0 && rate <= 1000000 && burst >= 1;
+}
+
+int main(int argc, char **argv) {
+    string mode = "fork";
+    int workers = 1;
+    bool migrateSpool = false;
+    const char *addCredential = NULL;
+
+    ////////////////////////////////////////////////////////////////////////////
+    // COMMAND LINE
+    // https://man7.org/linux/man-pages/man3/getopt.3.html
+    static struct option longOptions[] = {
+            {"mode", required_argument, NULL, 'm'},
+            {"workers", required_argument, NULL, 'w'},
+            {"auth", required_argument, NULL, 'a'},
+            {"ldap", required_argument, NULL, 'l'},
+            {"ldap-pool", required_argument, NULL, 'p'},
+            {"ldap-timeout", required_argument, NULL, 'o'},
+            {"bind-cache-ttl", required_argument, NULL, 't'},
+            {"storage", required_argument, NULL, 's'},
+            {"sync", required_argument, NULL, 'y'},
+            {"commit-window", required_argument, NULL, 'c'},
+            {"disk-threads", required_argument, NULL, 'k'},
+            {"disk-stats", required_argument, NULL, 'd'},
+            {"ban-seconds", required_argument, NULL, 'b'},
+            {"ip-rate", required_argument, NULL, 'i'},
+            {"user-rate", required_argument, NULL, 'r'},
+            {"migrate-spool", no_argument, NULL, 'g'},
+            {"add-credential", required_argument, NULL, 'u'},
+            {"help", no_argument, NULL, 'h'},
+            {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:w:a:l:p:o:t:s:y:c:k:d:b:i:r:gu:h", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                mode = optarg;
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'a':
+                if (strcmp(optarg, "ldap") == 0) {
+                    authBackend = ldapAuthenticator();
+                } else if (strcmp(optarg, "local") == 0) {
+                    authBackend = localAuthenticator();
+                } else {
+                    printUsage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'l':
+                ldapUri = optarg;
+                break;
+            case 'p':
+                ldapPoolSize = atoi(optarg);
+                break;
+            case 'o':
+                ldapTimeout = atoi(optarg);
+                break;
+            case 't':
+                bindCacheTtl = atoi(optarg);
+                break;
+            case 's':
+                if (strcmp(optarg, "segments") == 0) {
+                    mailboxStorage = STORAGE_SEGMENTS;
+                } else if (strcmp(optarg, "files") == 0) {
+                    mailboxStorage = STORAGE_FILES;
+                } else {
+                    printUsage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'y':
+                if (strcmp(optarg, "off") == 0) {
+                    syncMode = SYNC_OFF;
+                } else if (strcmp(optarg, "each") == 0) {
+                    syncMode = SYNC_EACH;
+                } else if (strcmp(optarg, "group") == 0) {
+                    syncMode = SYNC_GROUP;
+                } else {
+                    printUsage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+                commitWindow = atoi(optarg);
+                break;
+            case 'k':
+                diskThreads = atoi(optarg);
+                break;
+            case 'd':
+                diskStatsInterval = atoi(optarg);
+                break;
+            case 'b':
+                blacklistBanSeconds = atoi(optarg);
+                break;
+            case 'i':
+                if (!parseRate(optarg, rateIPPerSecond, rateIPBurst)) {
+                    printUsage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                if (!parseRate(optarg, rateUserPerSecond, rateUserBurst)) {
+                    printUsage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'g':
+                migrateSpool = true;
+                break;
+            case 'u':
+                addCredential = optarg;
+                break;
+            default:
+                printUsage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if ((mode != "fork" && mode != "epoll" && mode != "uring") || workers < 1 || workers > MAX_WORKERS ||
+        ldapPoolSize < 0 || ldapTimeout < 1 || commitWindow < 0 || diskThreads < 0 || diskThreads > DISK_THREADS_MAX ||
+        diskStatsInterval < 0 || blacklistBanSeconds < 1) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // mailboxes move under their own lock, servers may be running
+    if (migrateSpool) {
+        printf("Moved %d mailboxes\n", mailboxMigrateAll());
+        return EXIT_SUCCESS;
+    }
+
+    if (addCredential != NULL) {
+        string password;
+        getline(cin, password);
+        return credStoreSet(addCredential, password) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    // mapped before the fork, every process shares the pages
+    if (authBackend == localAuthenticator() && credStoreOpen() == -1) {
+        fprintf(stderr, "no credential database %s, create it with --add-credential\n", CRED_FILE);
+        return EXIT_FAILURE;
+    }
 
     ////////////////////////////////////////////////////////////////////////////
     // SIGNAL HANDLER
@@ -71,6 +299,168 @@ int main(void) {
         perror("signal can not be registered");
         return EXIT_FAILURE;
     }
+    // pooled directory connections may be closed by the server while idle,
+    // libldap writing to one must fail with EPIPE instead of killing us
+    signal(SIGPIPE, SIG_IGN);
+
+    // before any fork, every worker and child shares it
+    if (bindCacheTtl > 0 && bindCacheInit() == -1) {
+        fprintf(stderr, "bind cache disabled\n");
+    }
+
+    if (syncMode == SYNC_GROUP && groupCommitInit() == -1) {
+        fprintf(stderr, "group commit disabled, every SEND syncs alone\n");
+    }
+
+    if (blacklistInit() == -1) {
+        fprintf(stderr, "blacklist disabled, nobody is banned\n");
+    }
+    if (attemptsInit() == -1) {
+        fprintf(stderr, "failed LOGINs not counted, nobody is banned\n");
+    }
+    if (rateInit() == -1) {
+        fprintf(stderr, "rate limits disabled\n");
+    }
+
+    // before the listeners, it must not hold one
+    startCompactor();
+
+    if (workers == 1) {
+        if ((create_socket = createListener()) == -1) {
+            stopCompactor();
+            return EXIT_FAILURE;
+        }
+        int status = serve(mode);
+        stopCompactor();
+        return status;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    // WORKER PROCESSES
+    // every worker gets its own listening socket on the same port
+    // (SO_REUSEPORT), the kernel spreads new connections over them, so there
+    // is no shared accept queue the workers have to fight over
+    // https://man7.org/linux/man-pages/man7/socket.7.html
+    int listeners[MAX_WORKERS];
+    for (int i = 0; i < workers; i++) {
+        if ((listeners[i] = createListener()) == -1) {
+            stopCompactor();
+            return EXIT_FAILURE;
+        }
+    }
+
+    long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpuCount < 1) {
+        cpuCount = 1;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            perror("fork worker failed");
+            abortRequested = 1;
+            break;
+        }
+        else if (pid == 0) {
+            for (int j = 0; j < workers; j++) {
+                if (j != i) {
+                    close(listeners[j]);
+                }
+            }
+            workerCount = 0;
+            compactorPid = -1;
+            create_socket = listeners[i];
+
+            // pin to one core
+            // https://man7.org/linux/man-pages/man2/sched_setaffinity.2.html
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % cpuCount, &cpus);
+            if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+                perror("sched_setaffinity");
+            }
+
+            printf("Worker %d started on core %ld\n", i, i % cpuCount);
+            exit(serve(mode));
+        }
+        worker_pids[workerCount] = pid;
+        workerCount++;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        close(listeners[i]);
+    }
+
+    if (abortRequested) {
+        for (int i = 0; i < workerCount; i++) {
+            kill(worker_pids[i], SIGINT);
+        }
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // WAIT FOR WORKER PROCESSES
+    // SIGINT is passed on to the workers by signalHandler()
+
+    for (int i = 0; i < workerCount; i++) {
+        int status;
+        pid_t terminated_pid;
+        while ((terminated_pid = waitpid(worker_pids[i], &status, 0)) == -1 && errno == EINTR);
+
+        if (terminated_pid == -1) {
+            perror("waitpid worker");
+        } else if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            printf("Worker process %d terminated successfully.\n", terminated_pid);
+        } else {
+            printf("Worker process %d terminated with an error.\n", terminated_pid);
+        }
+    }
+
+    stopCompactor();
+    return EXIT_SUCCESS;
+}
+
+// one process does the housekeeping of the mailboxes (mailboxCompactAll) and
+// of the blacklist (blacklistTick, every second), sessions never wait for it
+// beyond the mailbox lock
+void startCompactor() {
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork compactor failed");
+    }
+    else if (pid == 0) {
+        workerCount = 0;
+        printf("Compactor started\n");
+        for (int second = 0; !abortRequested; second++) {
+            if (second % COMPACT_INTERVAL == 0) {
+                mailboxCompactAll();
+            }
+            blacklistTick();
+            // sleep() returns early on SIGINT
+            sleep(1);
+        }
+        exit(EXIT_SUCCESS);
+    }
+    else {
+        compactorPid = pid;
+    }
+}
+
+void stopCompactor() {
+    if (compactorPid == -1) {
+        return;
+    }
+    kill(compactorPid, SIGINT);
+    while (waitpid(compactorPid, NULL, 0) == -1 && errno == EINTR);
+    compactorPid = -1;
+}
+
+// socket bound to PORT and listening, -1 on error
+int createListener() {
+    struct sockaddr_in address;
+    int reuseValue = 1;
+    int listenSocket;
 
     ////////////////////////////////////////////////////////////////////////////
     // CREATE A SOCKET
@@ -78,9 +468,9 @@ int main(void) {
     // https://man7.org/linux/man-pages/man7/ip.7.html
     // https://man7.org/linux/man-pages/man7/tcp.7.html
     // IPv4, TCP (connection oriented), IP (same as client)
-    if ((create_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    if ((listenSocket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
         perror("Socket error"); // errno set by socket()
-        return EXIT_FAILURE;
+        return -1;
     }
 
     ////////////////////////////////////////////////////////////////////////////
@@ -88,16 +478,18 @@ int main(void) {
     // https://man7.org/linux/man-pages/man2/setsockopt.2.html
     // https://man7.org/linux/man-pages/man7/socket.7.html
     // socket, level, optname, optvalue, optlen
-    if (setsockopt(create_socket, SOL_SOCKET, SO_REUSEADDR, &reuseValue,
+    if (setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuseValue,
                    sizeof(reuseValue)) == -1) {
         perror("set socket options - reuseAddr");
-        return EXIT_FAILURE;
+        close(listenSocket);
+        return -1;
     }
 
-    if (setsockopt(create_socket, SOL_SOCKET, SO_REUSEPORT, &reuseValue,
+    if (setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &reuseValue,
                    sizeof(reuseValue)) == -1) {
         perror("set socket options - reusePort");
-        return EXIT_FAILURE;
+        close(listenSocket);
+        return -1;
     }
 
     ////////////////////////////////////////////////////////////////////////////
@@ -110,19 +502,68 @@ int main(void) {
 
     ////////////////////////////////////////////////////////////////////////////
     // ASSIGN AN ADDRESS WITH PORT TO SOCKET
-    if (bind(create_socket, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    if (bind(listenSocket, (struct sockaddr *)&address, sizeof(address)) == -1) {
         perror("bind error");
-        return EXIT_FAILURE;
+        close(listenSocket);
+        return -1;
     }
 
     ////////////////////////////////////////////////////////////////////////////
     // ALLOW CONNECTION ESTABLISHING
     // Socket, Backlog (= count of waiting connections allowed)
-    if (listen(create_socket, 5) == -1) {
+    if (listen(listenSocket, LISTEN_BACKLOG) == -1) {
         perror("listen error");
-        return EXIT_FAILURE;
+        close(listenSocket);
+        return -1;
+    }
+
+    return listenSocket;
+}
+
+// runs the accept loop of the chosen mode on create_socket until abort
+int serve(const string &mode) {
+    if (mode == "epoll" || mode == "uring") {
+        ////////////////////////////////////////////////////////////////////////
+        // RAISE DESCRIPTOR LIMIT
+        // in these modes open descriptors are the only limit on connections
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+                perror("setrlimit");
+            }
+        }
+
+        if (mode == "epoll") {
+            epollLoop();
+        } else {
+            uringLoop();
+        }
+
+        // all sessions of this process shared the directory connections
+        ldapPoolClose();
+    } else {
+        forkLoop();
+    }
+
+    // frees the descriptor
+    if (create_socket != -1) {
+        if (shutdown(create_socket, SHUT_RDWR) == -1) {
+            perror("shutdown create_socket");
+        }
+        if (close(create_socket) == -1) {
+            perror("close create_socket");
+        }
+        create_socket = -1;
     }
 
+    return EXIT_SUCCESS;
+}
+
+void forkLoop() {
+    socklen_t addrlen;
+    struct sockaddr_in cliaddress;
+
     while (!abortRequested) {
         /////////////////////////////////////////////////////////////////////////
         // ignore errors here... because only information message
@@ -142,25 +583,34 @@ int main(void) {
             }
             break;
         }
+        // banned networks and addresses over their rate don't even get a
+        // child (blacklist.h, ratelimit.h)
+        if (blacklistRange((struct sockaddr *)&cliaddress) || !rateAllowAddress((struct sockaddr *)&cliaddress)) {
+            close(new_socket);
+            new_socket = -1;
+            continue;
+        }
 
         /////////////////////////////////////////////////////////////////////////
         // FORKING
 
         pid_t pid = fork();
-        child_pids[childCount] = pid;
-        childCount++;
+        if (pid > 0 && childCount < MAX_CHILDREN) {
+            child_pids[childCount] = pid;
+            childCount++;
+        }
 
         if(pid < 0){
             perror("fork failed");
-            return EXIT_FAILURE;
+            break;
         }
         else if(pid == 0){
             close(create_socket);
+            compactorPid = -1;
             printf("Child process created!\n");
             comm_args args = {
                     new_socket,
-                    inet_ntoa(cliaddress.sin_addr),
-                    &loginAttempt
+                    inet_ntoa(cliaddress.sin_addr)
             };
 
             clientCommunication(args);
@@ -174,17 +624,6 @@ int main(void) {
         new_socket = -1;
     }
 
-    // frees the descriptor
-    if (create_socket != -1) {
-        if (shutdown(create_socket, SHUT_RDWR) == -1) {
-            perror("shutdown create_socket");
-        }
-        if (close(create_socket) == -1) {
-            perror("close create_socket");
-        }
-        create_socket = -1;
-    }
-
     /////////////////////////////////////////////////////////////////////////
     // WAIT FOR CHILD PROCESSES
 
@@ -207,468 +646,71 @@ int main(void) {
     }
 
     while(wait(NULL) > 0);
-
-    return EXIT_SUCCESS;
 }
 
-void clientCommunication(comm_args args) {
-    char buffer[BUF];
-    int size;
-
-    int* current_socket = &args.socket;
-    string clientIP = (string) args.clientIP;
-    int* loginAttempt = (int*) args.loginAttempt;
-
-
-    bool loggedIn = false;
-    string username;
-
-    /////////////////////////////////////////////////////////////////////////////
-
-    // LDAP config
-    // anonymous bind with user and pw empty
-    const char *ldapUri = "ldap://ldap.technikum-wien.at:389";
-    const int ldapVersion = LDAP_VERSION3;
-
-    int rc = 0; // return code
-
-    // setup LDAP connection
-    LDAP *ldapHandle;
-
-    rc = ldap_initialize(&ldapHandle, ldapUri);
-
-    if (rc != LDAP_SUCCESS)
-    {
-        fprintf(stderr, "ldap_init failed\n");
-    }
-
-    printf("connected to LDAP server %s\n", ldapUri);
-
-    // set verison options
-    rc = ldap_set_option(ldapHandle, LDAP_OPT_PROTOCOL_VERSION, &ldapVersion);             // IN-Value
-
-    if (rc != LDAP_OPT_SUCCESS){
-        fprintf(stderr, "ldap_set_option(PROTOCOL_VERSION): %s\n", ldap_err2string(rc));
-        ldap_unbind_ext_s(ldapHandle, NULL, NULL);
-    }
-
-    // start connection secure (initialize TLS)
-    rc = ldap_start_tls_s(ldapHandle, NULL, NULL);
-
-    if (rc != LDAP_SUCCESS){
-        fprintf(stderr, "ldap_start_tls_s(): %s\n", ldap_err2string(rc));
-        ldap_unbind_ext_s(ldapHandle, NULL, NULL);
-    }
-
-    ////////////////////////////////////////////////////////////////////////////
-    // SEND welcome message
-    strcpy(buffer, "Welcome to myserver!\r\nPlease enter your commands...\r\n");
-    if (send(*current_socket, buffer, strlen(buffer), 0) == -1) {
-        perror("send failed");
-        //return NULL;
-    }
+// fork mode: the child owns the socket and uses plain blocking calls,
+// so the session coroutine never suspends
+class blockingConnection : public connection {
+public:
+    bool receive() override {
+        size_t available;
+        char *buffer = s.in.reserve(BUF, &available);
+        if (buffer == NULL) {
+            return true; // full, the session handles what is there first
+        }
 
-    do {
-        /////////////////////////////////////////////////////////////////////////
-        // RECEIVE
-        size = recv(*current_socket, buffer, BUF - 1, 0);
+        int size = recv(s.socket, buffer, available, 0);
         if (size == -1) {
             if (abortRequested) {
                 perror("recv error after aborted");
             } else {
                 perror("recv error");
             }
-            break;
+            s.closed = true;
+            return true;
         }
 
         if (size == 0) {
             printf("Client closed remote socket\n"); // ignore error
-            break;
+            s.closed = true;
+            return true;
         }
-        buffer[size] = '\0';
-
-        /////////////////////////////////////////////////////////////////////////
-        // SPLIT INPUT
-
-        vector<string> input;
-        string current;
-
-        for (int i = 0; i < size; i++) {
-            if (buffer[i] != '\n') {
-                current += buffer[i];
-            } else {
-                input.push_back(current);
-                current = "";
-            }
-        }
-        if(current[0]){
-            input.push_back(current);
-            current = "";
-        }
-
-        int inputSize = input.size();
-
-        /////////////////////////////////////////////////////////////////////////
-        // login command
-
-        // 1. username and password
-        // 2. respond with OK or ERR
-        // 3. enable all other commands for the running session
-        // 4. allow only 3 attempts
-        // 4.1. blacklist ip after 3 failed attempts for 1min
-
-        bool blacklisted = false;
-
-        if (input[0] == "LOGIN") {
-            cout << input[1] << endl;
-            cout << input[2] << endl;
-
-            string output = "";
-
-            string blacklistPath = "..";
-            DIR *dirPointer = opendir(blacklistPath.c_str());
-
-            string fPath = blacklistPath + "/blacklist.txt";
-
-            // open file in reader
-            ifstream blacklist(fPath);
-
-            if (blacklist) {
-                string line = "";
-
-                // handle lines
-                while (getline(blacklist, line)) {
-                    if (line == clientIP){
-                        blacklisted = true;
-                    }
-                }
-
-                // close file
-                blacklist.close();
-            } else {
-                cout << "Unable to open file" << endl;
-                output = "ERR\n";
-            }
-            closedir(dirPointer);
-
-            if (blacklisted) {
-                printf("Invalid LOGIN command.\n");
-                output = "ERR\n";
-            } else {
-                // bind credentials
-                char ldapBindUser[256];
-                char ldapBindPassword[256];
-                char rawLdapUser[128];
-
-                strcpy(rawLdapUser, input[1].c_str());
-                sprintf(ldapBindUser, "uid=%s,ou=people,dc=technikum-wien,dc=at", rawLdapUser);
-                strcpy(ldapBindPassword, input[2].c_str());
-
-                username = rawLdapUser;
-
-                BerValue bindCredentials;
-                bindCredentials.bv_val = (char *)ldapBindPassword;
-                bindCredentials.bv_len = strlen(ldapBindPassword);
-                BerValue *servercredp; // server's credentials
-
-                cout << rawLdapUser << endl;
-                cout << ldapBindUser << endl;
-                cout << ldapBindPassword << endl;
-
-                rc = ldap_sasl_bind_s(ldapHandle, ldapBindUser, LDAP_SASL_SIMPLE, &bindCredentials, NULL, NULL, &servercredp);
-
-                cout << rc << endl;
-
-                strcpy(ldapBindUser, "");
-                strcpy(ldapBindPassword, "");
-                strcpy(rawLdapUser, "");
-
-                if (rc != LDAP_SUCCESS){
-                    fprintf(stderr, "LDAP bind error: %s\n", ldap_err2string(rc));
-                    loggedIn = false;
-                    *loginAttempt += 1;
-                    cout << "Login attempts: " << *loginAttempt << endl;
-                    output = "ERR\n";
-                }
-                else{
-                    loggedIn = true;
-                    output = "OK\n";
-                }
-
-                if(*loginAttempt >= 3){
-                    string inputPath = "..";
-                    opendir(inputPath.c_str());
-
-                    string filePath = inputPath + "/blacklist.txt";
-
-                    // open file in reader
-                    ofstream file(filePath);
-
-                    if (file) {
-                        // add
-                        file << clientIP << "\n";
-
-                        // close file
-                        file.close();
 
-                        output = "ERR\n";
-
-                    } else {
-                        cout << "Unable to open file" << endl;
-                        output = "ERR\n";
-                    }
-                    closedir(dirPointer);
-                }
-            }
-
-            if(loggedIn){
-                printf("Test succeeded\n");
-            }
-
-            strcpy(buffer, output.c_str());
-        }
-
-            /////////////////////////////////////////////////////////////////////////
-
-        else if (input[0] == "SEND" && loggedIn) {
-            string message = input[3];
-            message += '\n';
-            for(long unsigned int i = 4; i < input.size(); i++){
-                message += input[i];
-                message += '\n';
-            }
-
-            string output = "";
-            if (inputSize < 4) {
-                printf("Invalid SEND command.\n");
-                output = "ERR\n";
-            }
-
-            else {
-                string sender = username;
-                string receiver = input[1];
-                string subject = input[2];
-
-                // 1. check if receiver has folder, if not -> create
-                string inputPath = "../mail-spooler/" + receiver;
-                string messageName = sender + "_" + subject + ".txt";
-
-                DIR *directoryPointer = opendir(inputPath.c_str());
-
-                if (directoryPointer == NULL) {
-                    perror("opendir");
-                    // Creating a directory if not existing
-                    if (mkdir(inputPath.c_str(), 0777) == -1) {
-                        cerr << "Error :  " << strerror(errno) << endl;
-                        output = "ERR\n";
-                    } else {
-                        cout << "Directory created \n";
-                    }
-                }
-
-                // 2. create textfile in correct folder
-                ofstream file(inputPath + "/" + messageName);
-
-                // 3. write sender, receiver, subject and message into textfile
-                file << sender << "\n";
-                file << receiver << "\n";
-                file << subject << "\n";
-                file << message;
-
-                file.close();
-                closedir(directoryPointer);
-
-                if (output != "ERR\n") {
-                    output = "OK\n";
-                }
-            }
-            strcpy(buffer, output.c_str());
-        }
-
-            /////////////////////////////////////////////////////////////////////////
-
-        else if (input[0] == "LIST" && loggedIn) {
-
-            string output = "";
-
-            if (inputSize < 1) {
-                strcpy(buffer, "Invalid LIST command\r\n");
-            } else {
-                int msgCnt = 0;
-                string user = username;
-
-                // get and open directory for user (if existing)
-                string inputPath = "../mail-spooler/" + user;
-
-                DIR *directoryPointer = opendir(inputPath.c_str());
-                struct dirent *entry;
-
-                if (directoryPointer == NULL) {
-                    perror("opendir");
-                    output = "User unkown \n";
-                } else {
-                    // Reading all the entries in the directory
-                    while ((entry = readdir(directoryPointer)) != NULL) {
-                        // send entry name to client
-                        output += entry->d_name;
-                        output += "\n";
-                        msgCnt++;
-                    }
-                    closedir(directoryPointer); // close all directory
-                }
-
-                // convert message to c_str and copy to buffer
-                if (msgCnt > 0) {
-                    msgCnt -= 2;
-                }
-
-                output += "Total message count: ";
-                output += to_string(msgCnt);
-
-                strcpy(buffer, output.c_str());
-            }
-        }
-
-            /////////////////////////////////////////////////////////////////////////
-
-        else if (input[0] == "READ" && loggedIn) {
-            string user = username;
-            int msgNr = stoi(input[1]);
-
-            string output = "";
-
-            string path = "../mail-spooler/" + user;
+        s.in.commit(size);
+        return true;
+    }
 
-            // open user directory (if existing)
-            DIR *directoryPointer = opendir(path.c_str());
-            struct dirent *entry;
+    void waitReceive(std::coroutine_handle<>) override {}
 
-            if (directoryPointer == NULL) {
-                perror("opendir");
-                output = "ERR\n";
-            } else {
-                // count files in directory until msgCount matches input fileNr
-                int msgCount = 0;
-                while ((entry = readdir(directoryPointer)) != NULL) {
-                    if (entry->d_type == DT_REG) {
-                        if (msgCount == msgNr) {
-                            // Open the exact msgNr file in a folder
-                            string filePath = path + "/" + entry->d_name;
-                            cout << "Filepath: " << filePath << endl;
-
-                            // open file in reader
-                            ifstream file(filePath);
-
-                            if (file) {
-                                output += "OK\n";
-                                string line = "";
-
-                                // handle lines
-                                while (getline(file, line)) {
-                                    output += line;
-                                    output += "\n";
-                                }
-
-                                //removing last '\n'
-                                string::iterator iter = output.end();
-                                iter--;
-                                output.erase(iter);
-
-                                // close file
-                                file.close();
-                            } else {
-                                cout << "Unable to open file" << endl;
-                                output = "ERR\n";
-                            }
-
-                            break; // Exit the loop once the desired file is found
-                        }
-
-                        msgCount++;
-                    }
+    bool send() override {
+        while (!s.out.empty()) {
+            if (s.out.sendTo(s.socket, MSG_NOSIGNAL) == -1) {
+                if (errno == EINTR) {
+                    continue;
                 }
-                closedir(directoryPointer); // close all directory
+                perror("send failed");
+                s.closed = true;
+                break;
             }
-
-            strcpy(buffer, output.c_str());
         }
+        s.out.clear();
+        return true;
+    }
 
-            /////////////////////////////////////////////////////////////////////////
-
-        else if (input[0] == "DEL" && loggedIn) {
-            string user = username;
-            int msgNr = stoi(input[1]);
-
-            string output = "";
-
-            string path = "../mail-spooler/" + user;
-
-            // open user directory (if existing)
-            DIR *directoryPointer = opendir(path.c_str());
-            struct dirent *entry;
-
-            if (directoryPointer == NULL) {
-                perror("opendir");
-                output = "ERR\n";
-            } else {
-                // count files in directory until msgCount matches input fileNr
-                int msgCount = 0;
-                while ((entry = readdir(directoryPointer)) != NULL) {
-                    if (entry->d_type == DT_REG) {
-                        if (msgCount == msgNr) {
-                            // Open the exact msgNr file in a folder
-                            string filePath = path + "/" + entry->d_name;
-                            cout << "Filepath: " << filePath << endl;
-
-                            // Delete the file
-                            if (remove(filePath.c_str()) != 0) {
-                                cout << "Unable to delete file" << endl;
-                                output = "ERR\n";
-                            } else {
-                                output = "OK\n";
-                            }
-
-                            break; // Exit the loop once the desired file is found
-                        }
-                        msgCount++;
-                    } else {
-                        output = "ERR\n";
-                    }
-                }
-                closedir(directoryPointer); // close all directory
-            }
-
-            strcpy(buffer, output.c_str());
-        }
+    void waitSend(std::coroutine_handle<>) override {}
+};
 
-            /////////////////////////////////////////////////////////////////////////
+void clientCommunication(comm_args args) {
+    blockingConnection conn;
+    conn.s.socket = args.socket;
+    conn.s.clientIP = args.clientIP;
 
-        else if (input[0] == "QUIT") {
-            string output = "quit";
-            cout << "quit initiated" << endl;
-            strcpy(buffer, output.c_str());
-        }
+    int* current_socket = &conn.s.socket;
 
-            /////////////////////////////////////////////////////////////////////////
+    // returns once the session is over
+    startSession(&conn);
 
-        else {
-            if(loggedIn){
-                cout << input[0]
-                     << " | Command not recognized. Try SEND/LIST/READ/DEL/QUIT" << endl;
-            }
-            else{
-                cout << "Try loggin in first, kekw" << endl;
-            }
-        }
-
-        /////////////////////////////////////////////////////////////////////////
-
-        // send response after every command
-        if (send(*current_socket, buffer, strlen(buffer), 0) == -1) {
-            perror("send failed");
-            //return NULL;
-        }
-    } while (strcmp(buffer, "quit") != 0 && !abortRequested);
+    ldapPoolClose();
 
     // closes/frees the descriptor if not already
     if (*current_socket != -1) {
@@ -680,14 +722,21 @@ void clientCommunication(comm_args args) {
         }
         *current_socket = -1;
     }
-
-    //return NULL;
 }
 
 void signalHandler(int sig) {
     if (sig == SIGINT) {
         printf("abort Requested... \r\n"); // ignore error
         abortRequested = 1;
+
+        // parent of --workers: let every worker shut down on its own
+        for (int i = 0; i < workerCount; i++) {
+            kill(worker_pids[i], SIGINT);
+        }
+        if (compactorPid != -1) {
+            kill(compactorPid, SIGINT);
+        }
+
         /////////////////////////////////////////////////////////////////////////
         // With shutdown() one can initiate normal TCP close sequence ignoring
         // the reference count.
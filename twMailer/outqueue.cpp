@@ -0,0 +1,129 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "outqueue.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+void outQueue::push(string data) {
+    if (data.empty()) {
+        return;
+    }
+    outPart part;
+    part.length = data.size();
+    part.data = std::move(data);
+    bytes += part.length;
+    parts.push_back(std::move(part));
+}
+
+void outQueue::pushFile(int fd, off_t offset, size_t length) {
+    if (length == 0) {
+        close(fd);
+        return;
+    }
+    outPart part;
+    part.fd = fd;
+    part.offset = offset;
+    part.length = length;
+    bytes += length;
+    parts.push_back(std::move(part));
+}
+
+void outQueue::append(outQueue &other) {
+    for (deque<outPart>::iterator it = other.parts.begin(); it != other.parts.end(); ++it) {
+        bytes += it->length;
+        parts.push_back(std::move(*it));
+    }
+    other.parts.clear();
+    other.bytes = 0;
+}
+
+void outQueue::clear() {
+    for (deque<outPart>::iterator it = parts.begin(); it != parts.end(); ++it) {
+        if (it->fd != -1) {
+            close(it->fd);
+        }
+    }
+    parts.clear();
+    bytes = 0;
+}
+
+int outQueue::gather(struct iovec *iov, int max) const {
+    int count = 0;
+    for (deque<outPart>::const_iterator it = parts.begin(); it != parts.end() && count < max; ++it) {
+        if (it->fd != -1) {
+            break;
+        }
+        iov[count].iov_base = (void *)(it->data.data() + it->offset);
+        iov[count].iov_len = it->length;
+        count++;
+    }
+    return count;
+}
+
+const outPart *outQueue::frontFile() const {
+    if (parts.empty() || parts.front().fd == -1) {
+        return NULL;
+    }
+    return &parts.front();
+}
+
+void outQueue::advance(size_t count) {
+    bytes -= count;
+    while (count > 0) {
+        outPart &front = parts.front();
+        if (count < front.length) {
+            front.offset += count;
+            front.length -= count;
+            return;
+        }
+        count -= front.length;
+        if (front.fd != -1) {
+            close(front.fd);
+        }
+        parts.pop_front();
+    }
+}
+
+ssize_t outQueue::sendTo(int socket, int flags) {
+    const outPart *file = frontFile();
+    if (file != NULL) {
+        off_t offset = file->offset;
+        ssize_t n = sendfile(socket, file->fd, &offset, file->length);
+        if (n == 0) {
+            // the file got shorter than announced
+            errno = EIO;
+            return -1;
+        }
+        if (n > 0) {
+            advance(n);
+        }
+        return n;
+    }
+
+    struct iovec iov[OUT_MAX_IOV];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = gather(iov, OUT_MAX_IOV);
+
+    // a header in front of a file part goes out together with its start
+    size_t total = 0;
+    for (size_t i = 0; i < msg.msg_iovlen; i++) {
+        total += iov[i].iov_len;
+    }
+    if (total < bytes) {
+        flags |= MSG_MORE;
+    }
+
+    ssize_t n = sendmsg(socket, &msg, flags);
+    if (n > 0) {
+        advance(n);
+    }
+    return n;
+}
@@ -0,0 +1,64 @@
+#ifndef OUTQUEUE_H
+#define OUTQUEUE_H
+
+#include <deque>
+#include <stddef.h>
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+///////////////////////////////////////////////////////////////////////////////
+
+// most parts handed to one writev/sendmsg
+#define OUT_MAX_IOV 64
+// queued response bytes after which a pipelined batch is sent early
+#define OUT_BATCH_SIZE (64 * 1024)
+
+// a queued response or a piece of one
+// either bytes in memory or a range of an open file (sent with sendfile/splice)
+struct outPart {
+    std::string data;
+    int fd = -1;       // file part, closed by the queue once it is sent
+    off_t offset = 0;  // sent bytes of data, or the file position
+    size_t length = 0; // bytes not sent yet
+};
+
+// responses waiting for the socket, in the order the commands came in
+// every response stays its own part (moved in, never copied together) and
+// everything queued goes out with one sendmsg, so pipelined commands that
+// were handled in the same round share one system call
+// file parts never enter user space, see sendTo()
+class outQueue {
+public:
+    outQueue() {}
+    ~outQueue() { clear(); }
+    outQueue(const outQueue &) = delete;
+    outQueue &operator=(const outQueue &) = delete;
+
+    void push(std::string data);
+    // takes over fd, the bytes [offset, offset + length) are sent from it
+    void pushFile(int fd, off_t offset, size_t length);
+    // moves everything queued in other to the end of this queue
+    void append(outQueue &other);
+    bool empty() const { return parts.empty(); }
+    size_t size() const { return bytes; } // bytes not sent yet
+    void clear();
+
+    // fills iov with the unsent bytes up to the first file part
+    // returns the number of entries
+    int gather(struct iovec *iov, int max) const;
+    // the file part at the front, NULL if the front is in memory (or empty)
+    const outPart *frontFile() const;
+    // drops count sent bytes from the front
+    void advance(size_t count);
+
+    // one sendmsg of the queued memory parts, or one sendfile if a file part
+    // is at the front, returns what the system call returned
+    ssize_t sendTo(int socket, int flags);
+
+private:
+    std::deque<outPart> parts;
+    size_t bytes = 0;
+};
+
+#endif
@@ -0,0 +1,88 @@
+#include "protocol.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void put16(char *bytes, uint16_t value) {
+    bytes[0] = value >> 8;
+    bytes[1] = value;
+}
+
+static void put32(char *bytes, uint32_t value) {
+    bytes[0] = value >> 24;
+    bytes[1] = value >> 16;
+    bytes[2] = value >> 8;
+    bytes[3] = value;
+}
+
+static void putHeader(char *header, int type, int flags, uint32_t requestId, size_t fields, size_t length) {
+    header[0] = type;
+    header[1] = flags;
+    put16(header + 2, fields);
+    put32(header + 4, requestId);
+    put32(header + 8, length);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void v2AppendField(string &frame, string_view field) {
+    char length[4];
+    put32(length, field.size());
+    frame.append(length, sizeof(length));
+    frame.append(field);
+}
+
+void v2Finish(string &frame, int type, int flags, uint32_t requestId, size_t fields) {
+    putHeader(frame.data(), type, flags, requestId, fields, frame.size() - V2_HEADER_SIZE);
+}
+
+string v2Frame(int type, int flags, uint32_t requestId, const vector<string_view> &fields) {
+    string frame(V2_HEADER_SIZE, '\0');
+    for (size_t i = 0; i < fields.size(); i++) {
+        v2AppendField(frame, fields[i]);
+    }
+    v2Finish(frame, type, flags, requestId, fields.size());
+    return frame;
+}
+
+string v2Header(int type, int flags, uint32_t requestId, size_t fields, size_t length) {
+    string header(V2_HEADER_SIZE, '\0');
+    putHeader(header.data(), type, flags, requestId, fields, length);
+    return header;
+}
+
+string v2Number(uint32_t value) {
+    string number(4, '\0');
+    put32(number.data(), value);
+    return number;
+}
+
+uint16_t v2Get16(const char *bytes) {
+    const unsigned char *b = (const unsigned char *)bytes;
+    return b[0] << 8 | b[1];
+}
+
+uint32_t v2Get32(const char *bytes) {
+    const unsigned char *b = (const unsigned char *)bytes;
+    return (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+const char *v2CommandName(int type) {
+    switch (type) {
+        case V2_LOGIN:
+            return "LOGIN";
+        case V2_SEND:
+            return "SEND";
+        case V2_LIST:
+            return "LIST";
+        case V2_READ:
+            return "READ";
+        case V2_DEL:
+            return "DEL";
+        case V2_QUIT:
+            return "QUIT";
+        default:
+            return "";
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+
+// line of the welcome banner offering v2, the text command "V2" switches
+// (answered "OK" in text, everything after it is v2 in both directions)
+#define V2_OFFER "Protocol v2 available, send V2 to switch"
+
+#define V2_HEADER_SIZE 12
+
+// request types
+#define V2_LOGIN 1 // user, password
+#define V2_SEND 2  // receivers (comma separated), subject, body (any bytes)
+#define V2_LIST 3  // no fields
+#define V2_READ 4  // message number (4 bytes)
+#define V2_DEL 5   // message number (4 bytes)
+#define V2_QUIT 6  // no fields
+// response types
+#define V2_OK 0x80
+#define V2_ERR 0x81
+
+// flags
+#define V2_MORE 0x01 // more frames of the same response follow
+
+// protocol v2: every request and response is a frame, a 12 byte header
+//   type (1), flags (1), field count (2), request id (4), body length (4)
+// followed by the body, the fields, each a 4 byte length and that many bytes
+// (all numbers in network byte order)
+// a frame is taken apart by reading headers and lengths, nothing is scanned
+// for delimiters and a field may hold any bytes
+// a response carries the request id of its request, responses come in the
+// order of the requests, so requests can be pipelined as in text mode
+//   LOGIN, SEND, DEL, QUIT  OK or ERR without fields (QUIT closes afterwards)
+//   LIST  OK frames flagged V2_MORE with two fields per message (sender,
+//         subject), numbered on from 0, then OK with the count (4 bytes)
+//   READ  OK with the message as its one field, or ERR
+
+// a frame is built as V2_HEADER_SIZE bytes of room, the fields appended to
+// it, and the header written last
+void v2AppendField(std::string &frame, std::string_view field);
+void v2Finish(std::string &frame, int type, int flags, uint32_t requestId, size_t fields);
+// a whole frame in one go
+std::string v2Frame(int type, int flags, uint32_t requestId, const std::vector<std::string_view> &fields);
+// only the header, for a body sent from elsewhere (length: with the length
+// prefixes of its fields)
+std::string v2Header(int type, int flags, uint32_t requestId, size_t fields, size_t length);
+
+// a 4 byte number field
+std::string v2Number(uint32_t value);
+uint16_t v2Get16(const char *bytes);
+uint32_t v2Get32(const char *bytes);
+
+// text name of a request type ("LOGIN", ...), "" if there is none
+const char *v2CommandName(int type);
+
+#endif
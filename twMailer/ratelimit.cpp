@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "ratelimit.h"
+#include "util.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct rateSlot {
+    atomic<uint32_t> key;  // 0 = free
+    atomic<uint64_t> full; // when the bucket is full again, microseconds
+};
+
+// lives in shared memory, changed by compare and swap only
+struct rateState {
+    rateSlot ips[RATE_SLOTS];
+    rateSlot users[RATE_SLOTS];
+};
+
+static_assert(atomic<uint32_t>::is_always_lock_free && atomic<uint64_t>::is_always_lock_free);
+
+int rateIPPerSecond = RATE_DEFAULT_IP;
+int rateIPBurst = RATE_DEFAULT_IP_BURST;
+int rateUserPerSecond = RATE_DEFAULT_USER;
+int rateUserBurst = RATE_DEFAULT_USER_BURST;
+
+static rateState *state = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// the slot of key, taken over from a free or full bucket if it has none;
+// NULL if every slot of its probe sequence is busy
+static rateSlot *findSlot(rateSlot *table, uint32_t key, uint64_t now) {
+    while (true) {
+        rateSlot *freeSlot = NULL;
+        uint32_t freeKey = 0;
+        for (int i = 0; i < RATE_PROBE; i++) {
+            rateSlot *slot = &table[(firstSlot(key, RATE_SLOTS) + i) & (RATE_SLOTS - 1)];
+            uint32_t current = slot->key.load(memory_order_acquire);
+            if (current == key) {
+                return slot;
+            }
+            if (freeSlot == NULL && (current == 0 || slot->full.load(memory_order_acquire) <= now)) {
+                freeSlot = slot;
+                freeKey = current;
+            }
+        }
+        if (freeSlot == NULL) {
+            return NULL;
+        }
+        // another process took it meanwhile, look again
+        if (freeSlot->key.compare_exchange_weak(freeKey, key, memory_order_acq_rel)) {
+            return freeSlot;
+        }
+    }
+}
+
+static bool take(bool users, uint32_t key) {
+    int rate = users ? rateUserPerSecond : rateIPPerSecond;
+    int burst = users ? rateUserBurst : rateIPBurst;
+    if (state == NULL || key == 0 || rate <= 0) {
+        return true;
+    }
+    uint64_t now = nowUs();
+    rateSlot *slot = findSlot(users ? state->users : state->ips, key, now);
+    if (slot == NULL) {
+        return true;
+    }
+
+    uint64_t interval = 1000000 / rate;
+    uint64_t tolerance = interval * (max(burst, 1) - 1);
+    uint64_t full = slot->full.load(memory_order_acquire);
+    while (true) {
+        uint64_t start = max(full, now);
+        if (start - now > tolerance) {
+            return false;
+        }
+        // on failure full is reloaded, the loop decides anew
+        if (slot->full.compare_exchange_weak(full, start + interval, memory_order_acq_rel)) {
+            return true;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int rateInit() {
+    // zero filled, every bucket full
+    void *mem = mmap(NULL, sizeof(rateState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap rate limits");
+        return -1;
+    }
+    state = (rateState *)mem;
+    return 0;
+}
+
+bool rateAllowAddress(const struct sockaddr *address) {
+    if (address->sa_family != AF_INET) {
+        return true;
+    }
+    return take(false, ntohl(((const struct sockaddr_in *)address)->sin_addr.s_addr));
+}
+
+bool rateAllowIP(const string &ip) {
+    return take(false, ipKey(ip));
+}
+
+bool rateAllowUser(const string &user) {
+    return take(true, userKey(user));
+}
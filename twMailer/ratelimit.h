@@ -0,0 +1,50 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <string>
+#include <sys/socket.h>
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define RATE_SLOTS 65536 // power of two, per table
+#define RATE_PROBE 16    // slots looked at per address/user
+// connections and LOGINs per second an address may make (--ip-rate)
+#define RATE_DEFAULT_IP 50
+#define RATE_DEFAULT_IP_BURST 500
+// SENDs and READs per second a user may make, from any connections (--user-rate)
+#define RATE_DEFAULT_USER 100
+#define RATE_DEFAULT_USER_BURST 1000
+
+// token buckets per client address and per logged in user, shared by every
+// process of the server (anonymous shared memory set up before the
+// workers/children are forked), so one client can't get around them with
+// more connections, workers or children
+// a bucket is kept as the time it is full again (GCRA): taking a token moves
+// that time one interval (1 / rate) on, and is refused while it is more than
+// burst - 1 intervals ahead; a slot is the key and that time (microseconds
+// since boot), both only ever changed by compare and swap, so nobody takes a
+// lock on the way of an accept or a command; the slot of a bucket that is
+// full again is free for another key, which finds it just as it should
+// - addresses: checked right after accept (a connection over the limit is
+//   closed before it gets a session or a child) and by LOGIN, before the
+//   directory is asked
+// - users: checked by SEND and READ, the commands that cost disk bandwidth
+// users are kept by a 32 bit hash of their name, like attempts.h
+// a full table (more than RATE_PROBE busy keys on one probe sequence) limits
+// nobody new
+
+// rate 0 = no limit
+extern int rateIPPerSecond;
+extern int rateIPBurst;
+extern int rateUserPerSecond;
+extern int rateUserBurst;
+
+// -1 if the shared memory can't be set up, nobody is limited then
+int rateInit();
+
+// each takes a token, false if there was none left
+bool rateAllowAddress(const struct sockaddr *address);
+bool rateAllowIP(const std::string &ip);
+bool rateAllowUser(const std::string &user);
+
+#endif
@@ -0,0 +1,73 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ratelimit.h"
+#include "test.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// tokens taken in a row before the first refusal
+static int takeAll(bool (*allow)(const string &), const string &key) {
+    int taken = 0;
+    while (allow(key) && taken < 1000) {
+        taken++;
+    }
+    return taken;
+}
+
+static bool allowAddress(const char *ip) {
+    struct sockaddr_in in = {};
+    in.sin_family = AF_INET;
+    CHECK(inet_pton(AF_INET, ip, &in.sin_addr) == 1);
+    return rateAllowAddress((struct sockaddr *)&in);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main() {
+    // nobody is limited before rateInit()
+    CHECK(takeAll(rateAllowUser, "bob") == 1000);
+
+    // 10 per second, 5 at once: a token every 100 ms
+    rateUserPerSecond = 10;
+    rateUserBurst = 5;
+    rateIPPerSecond = 10;
+    rateIPBurst = 3;
+    CHECK(rateInit() == 0);
+
+    // a full bucket gives its burst, then refuses
+    CHECK(takeAll(rateAllowUser, "bob") == 5);
+    CHECK(!rateAllowUser("bob"));
+    // every user has a bucket of its own
+    CHECK(takeAll(rateAllowUser, "alice") == 5);
+
+    // refill: 250 ms are two tokens and a half
+    usleep(250 * 1000);
+    CHECK(takeAll(rateAllowUser, "bob") == 2);
+
+    // addresses, after accept and by LOGIN, share a bucket
+    CHECK(allowAddress("10.0.0.1") && allowAddress("10.0.0.1"));
+    CHECK(takeAll(rateAllowIP, "10.0.0.1") == 1);
+    CHECK(allowAddress("10.0.0.2"));
+    // only IPv4 addresses are limited
+    CHECK(takeAll(rateAllowIP, "::1") == 1000);
+
+    // the buckets are shared with processes forked afterwards
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(takeAll(rateAllowUser, "carol") == 5 ? 0 : 1);
+    }
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(!rateAllowUser("carol"));
+
+    // rate 0 turns the limit off
+    rateUserPerSecond = 0;
+    CHECK(takeAll(rateAllowUser, "bob") == 1000);
+
+    return testResult("ratelimittest");
+}
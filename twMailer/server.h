@@ -0,0 +1,15 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+///////////////////////////////////////////////////////////////////////////////
+
+// listening socket of this process (see myserver.cpp)
+extern int create_socket;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// accept loops of the single process modes, return once abort is requested
+void epollLoop();
+void uringLoop();
+
+#endif
@@ -0,0 +1,523 @@
+#include <algorithm>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// files
+#include <unistd.h>
+
+#include "attempts.h"
+#include "auth.h"
+#include "blacklist.h"
+#include "diskpool.h"
+#include "mailbox.h"
+#include "mailcache.h"
+#include "ratelimit.h"
+#include "session.h"
+#include "util.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// returns message number or -1 if input is not a plain number (in v2 a
+// 4 byte number)
+static int parseMessageNumber(const session &s, const vector<string_view> &input) {
+    if (s.v2) {
+        if (input.size() != 2 || input[1].length() != 4 || v2Get32(input[1].data()) > INT32_MAX) {
+            return -1;
+        }
+        return v2Get32(input[1].data());
+    }
+    if (input.size() < 2 || input[1].empty() || input[1].length() > 9) {
+        return -1;
+    }
+    int msgNr = 0;
+    for (unsigned int i = 0; i < input[1].length(); i++) {
+        if (!isdigit(input[1][i])) {
+            return -1;
+        }
+        msgNr = msgNr * 10 + (input[1][i] - '0');
+    }
+    return msgNr;
+}
+
+#define SEND_RECEIVERS_MAX 100 // receivers of one SEND
+
+// comma separated user names, each once in the order given; false if a name
+// isn't a valid user name (see util.h) or there are too many
+static bool parseReceivers(string_view list, vector<string> &receivers) {
+    while (true) {
+        size_t comma = list.find(',');
+        string_view name = list.substr(0, comma);
+        if (!validUser(name)) {
+            return false;
+        }
+        if (find(receivers.begin(), receivers.end(), name) == receivers.end()) {
+            if (receivers.size() == SEND_RECEIVERS_MAX) {
+                return false;
+            }
+            receivers.emplace_back(name);
+        }
+        if (comma == string_view::npos) {
+            return true;
+        }
+        list.remove_prefix(comma + 1);
+    }
+}
+
+// what a text line can hold; v2 fields that are stored or used as lines
+// (user names, subjects) must not bring in more
+static bool singleLine(string_view field) {
+    return field.find_first_of(string_view("\n\0", 2)) == string_view::npos;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+/////////////////////////////////////////////////////////////////////////
+// login command
+
+// 1. username and password
+// 2. respond with OK or ERR
+// 3. enable all other commands for the running session
+// 4. allow only 3 failed attempts per ip, counted across connections and
+//    forgiven over time (see attempts.h)
+// 4.1. blacklist ip after 3 failed attempts for 1min (--ban-seconds)
+// 4.2. refuse a user after 10 failed attempts from anywhere
+
+static task<string> handleLogin(session &s, vector<string_view> &input) {
+    bool blacklisted = false;
+    string output = "";
+
+    // a name SEND couldn't address is nobody's mailbox either
+    if (input.size() < 3 || !validUser(input[1])) {
+        printf("Invalid LOGIN command.\n");
+        co_return "ERR\n";
+    }
+
+    // the same key for the attempts checked and the failure counted
+    string user(input[1]);
+    cout << user << endl;
+
+    // in memory, no disk on the way (see blacklist.h)
+    blacklisted = blacklistCheck(s.clientIP);
+
+    if (blacklisted) {
+        printf("Invalid LOGIN command.\n");
+        output = "ERR\n";
+    } else if (!rateAllowIP(s.clientIP)) {
+        // a flood of LOGINs doesn't reach the backend (see ratelimit.h)
+        printf("Too many LOGINs from address.\n");
+        output = "ERR\n";
+    } else if (attemptsUser(user) >= ATTEMPTS_MAX_USER) {
+        // somebody is guessing, the backend isn't asked until it decayed
+        printf("Too many failed LOGINs for user.\n");
+        output = "ERR\n";
+    } else {
+        string password(input[2].substr(0, 255));
+
+        int verdict = co_await authBackend->verify(s.sched, user, password);
+
+        password.assign(password.size(), '\0');
+
+        // whoever was logged in before is not anymore, the mailbox only
+        // changes hands on success
+        if (verdict == AUTH_UNREACHABLE) {
+            // not the client's fault, doesn't count as an attempt
+            s.loggedIn = false;
+            output = "ERR\n";
+        }
+        else if (verdict == AUTH_REJECTED){
+            s.loggedIn = false;
+            int attempts = attemptsFailIP(s.clientIP);
+            attemptsFailUser(user);
+            cout << "Login attempts: " << attempts << endl;
+            output = "ERR\n";
+
+            if(attempts >= ATTEMPTS_MAX_IP){
+                blacklistBan(s.clientIP);
+                // the ban takes over, afterwards the address starts anew
+                attemptsClearIP(s.clientIP);
+            }
+        }
+        else{
+            s.loggedIn = true;
+            s.username = user;
+            attemptsClearUser(s.username);
+            output = "OK\n";
+        }
+    }
+
+    if(s.loggedIn){
+        printf("Test succeeded\n");
+    }
+
+    co_return output;
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+static string deliverMessage(const string &sender, const vector<string> &receivers, const string &subject,
+                             const string &message) {
+    if (mailboxDeliver(sender, receivers, subject, message) == -1) {
+        return "ERR\n";
+    }
+    return "OK\n";
+}
+
+static task<string> handleSend(session &s, vector<string_view> &input) {
+    if (input.size() < 4) {
+        printf("Invalid SEND command.\n");
+        co_return "ERR\n";
+    }
+    // the body is stored once, however many receivers get it
+    vector<string> receivers;
+    if (!parseReceivers(input[1], receivers)) {
+        printf("Invalid receivers.\n");
+        co_return "ERR\n";
+    }
+
+    // v2 has the body as one field, byte for byte; in text it is the lines
+    // up to the "." the parser ended the command with, which is not stored
+    // either way an empty body is refused
+    if (s.v2 ? input.size() != 4 || !singleLine(input[2]) || input[3].empty() : input.size() < 5) {
+        printf("Invalid SEND command.\n");
+        co_return "ERR\n";
+    }
+    string message(input[3]);
+    if (!s.v2) {
+        message += '\n';
+        for(long unsigned int i = 4; i < input.size() - 1; i++){
+            message += input[i];
+            message += '\n';
+        }
+    }
+
+    string output;
+    co_await blockingStep(s.sched, DISK_SEND,
+                          [&] { output = deliverMessage(s.username, receivers, string(input[2]), message); });
+    // a LIST right behind it must not see the cached indexes
+    for (const string &receiver : receivers) {
+        mailCacheInvalidate(receiver);
+    }
+    co_return output;
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+// LIST streams its response, only one chunk of it is in memory besides
+// what the socket has not taken yet (and the cached index, see mailcache.h)
+// messages are numbered by the mailbox index (mailbox.h), starting at 0
+
+#define LIST_CHUNK_RECORDS 512
+// READ sends bodies of at least this size with sendfile
+#define READ_SENDFILE_MIN (16 * 1024)
+
+static task<void> flushOutput(connection &conn) {
+    while (!conn.send()) {
+        co_await sendReady{conn};
+    }
+}
+
+// queues part of a response, waits for the socket once enough is queued
+static task<void> emit(connection &conn, string data) {
+    conn.s.out.push(std::move(data));
+    if (conn.s.out.size() >= OUT_BATCH_SIZE) {
+        co_await flushOutput(conn);
+    }
+}
+
+// one line per message: "<nr>: <sender>: <subject>"
+static string listLines(const mailRecord *records, size_t count, uint64_t first) {
+    string output;
+    for (size_t i = 0; i < count; i++) {
+        output += to_string(first + i);
+        output += ": ";
+        output.append(records[i].sender, records[i].senderLen);
+        output += ": ";
+        output.append(records[i].subject, records[i].subjectLen);
+        output += "\n";
+    }
+    return output;
+}
+
+// v2: sender and subject of each message as fields of one frame, more follow
+static string listFrame(const mailRecord *records, size_t count, uint32_t requestId) {
+    string frame(V2_HEADER_SIZE, '\0');
+    for (size_t i = 0; i < count; i++) {
+        v2AppendField(frame, string_view(records[i].sender, records[i].senderLen));
+        v2AppendField(frame, string_view(records[i].subject, records[i].subjectLen));
+    }
+    v2Finish(frame, V2_OK, V2_MORE, requestId, count * 2);
+    return frame;
+}
+
+static string listChunk(const session &s, const mailRecord *records, size_t count, uint64_t first) {
+    return s.v2 ? listFrame(records, count, s.in.requestId()) : listLines(records, count, first);
+}
+
+static string listEnd(const session &s, uint64_t msgCnt) {
+    if (s.v2) {
+        return v2Frame(V2_OK, 0, s.in.requestId(), {v2Number(msgCnt)});
+    }
+    return "Total message count: " + to_string(msgCnt) + "\n";
+}
+
+// "OK", one line per message, "Total message count: <n>"
+// (v2: see protocol.h)
+static task<void> handleList(connection &conn) {
+    session &s = conn.s;
+    uint64_t msgCnt = 0;
+
+    if (!s.v2) {
+        s.out.push("OK\n");
+    }
+    shared_ptr<const vector<mailRecord>> cached = mailCacheFind(s.username);
+    if (cached) {
+        // straight from memory
+        while (msgCnt < cached->size() && !s.closed) {
+            size_t count = min(cached->size() - msgCnt, (size_t)LIST_CHUNK_RECORDS);
+            string chunk = listChunk(s, cached->data() + msgCnt, count, msgCnt);
+            msgCnt += count;
+            co_await emit(conn, std::move(chunk));
+        }
+        co_await emit(conn, listEnd(s, msgCnt));
+        co_return;
+    }
+
+    // what is read anyway is kept for the cache, unless it gets too large
+    uint64_t ticket = mailCacheBegin(s.username);
+    vector<mailRecord> all;
+    bool complete = false;
+    while (!s.closed) {
+        vector<mailRecord> records;
+        int rc = 0;
+        co_await blockingStep(s.sched, DISK_LIST,
+                              [&] { rc = mailboxList(s.username, msgCnt, LIST_CHUNK_RECORDS, records); });
+        if (rc == -1) {
+            break;
+        }
+        if (records.empty()) {
+            complete = true;
+            break;
+        }
+        string chunk = listChunk(s, records.data(), records.size(), msgCnt);
+        msgCnt += records.size();
+
+        if (ticket != 0 && all.size() + records.size() <= MAIL_CACHE_MAILBOX_MAX) {
+            all.insert(all.end(), records.begin(), records.end());
+        } else if (ticket != 0) {
+            ticket = 0;
+            vector<mailRecord>().swap(all);
+        }
+        co_await emit(conn, std::move(chunk));
+    }
+    if (ticket != 0 && complete) {
+        mailCacheStore(s.username, ticket, std::move(all));
+    }
+
+    co_await emit(conn, listEnd(s, msgCnt));
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+// "ERR" of either protocol, for responses that are queued directly
+static string errorResponse(const session &s) {
+    return s.v2 ? v2Frame(V2_ERR, 0, s.in.requestId(), {}) : "ERR\n";
+}
+
+// "OK <bytes>" followed by exactly that many bytes of the stored message
+// (v2: OK with the message as its field)
+static task<void> handleRead(session &s, vector<string_view> &input) {
+    int msgNr = parseMessageNumber(s, input);
+
+    if (msgNr < 0) {
+        printf("Invalid READ command.\n");
+        s.out.push(errorResponse(s));
+        co_return;
+    }
+
+    int fd = -1;
+    off_t offset = 0;
+    size_t length = 0;
+    co_await blockingStep(s.sched, DISK_READ, [&] { fd = mailboxOpen(s.username, msgNr, offset, length); });
+    if (fd == -1) {
+        s.out.push(errorResponse(s));
+        co_return;
+    }
+
+    if (s.v2) {
+        s.out.push(v2Header(V2_OK, 0, s.in.requestId(), 1, 4 + length) + v2Number(length));
+    } else {
+        s.out.push("OK " + to_string(length) + "\n");
+    }
+    if (length >= READ_SENDFILE_MIN) {
+        // the body goes from the page cache to the socket (sendfile/splice)
+        s.out.pushFile(fd, offset, length);
+        co_return;
+    }
+
+    // small ones are cheaper to read than to keep an open file queued
+    string body;
+    co_await blockingStep(s.sched, DISK_READ, [&] {
+        body.resize(length);
+        ssize_t size = pread(fd, body.data(), body.size(), offset);
+        body.resize(size > 0 ? size : 0);
+    });
+    close(fd);
+    if (body.size() != length) {
+        // the announced length can't be kept anymore, end the session
+        printf("Message got shorter while reading, closing\n");
+        s.quit = true;
+    }
+    s.out.push(std::move(body));
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+static string deleteMessage(const string &user, int msgNr) {
+    if (mailboxDelete(user, msgNr) == -1) {
+        return "ERR\n";
+    }
+    return "OK\n";
+}
+
+static task<string> handleDel(session &s, vector<string_view> &input) {
+    int msgNr = parseMessageNumber(s, input);
+
+    if (msgNr < 0) {
+        printf("Invalid DEL command.\n");
+        co_return "ERR\n";
+    }
+
+    string output;
+    co_await blockingStep(s.sched, DISK_DEL, [&] { output = deleteMessage(s.username, msgNr); });
+    mailCacheInvalidate(s.username);
+    co_return output;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+task<void> handleCommand(connection &conn, vector<string_view> &input) {
+    session &s = conn.s;
+    string output;
+
+    if (input.empty()) {
+        output = "ERR\n";
+    }
+    else if (input[0] == "LOGIN") {
+        output = co_await handleLogin(s, input);
+    }
+    else if ((input[0] == "SEND" || input[0] == "READ") && s.loggedIn && !rateAllowUser(s.username)) {
+        // the disk work is refused, the session goes on (see ratelimit.h)
+        printf("Too many %s for user.\n", string(input[0]).c_str());
+        output = "ERR\n";
+    }
+    else if (input[0] == "SEND" && s.loggedIn) {
+        output = co_await handleSend(s, input);
+    }
+    else if (input[0] == "LIST" && s.loggedIn) {
+        co_await handleList(conn);
+    }
+    else if (input[0] == "READ" && s.loggedIn) {
+        co_await handleRead(s, input);
+    }
+    else if (input[0] == "DEL" && s.loggedIn) {
+        output = co_await handleDel(s, input);
+    }
+    else if (input[0] == "QUIT") {
+        cout << "quit initiated" << endl;
+        s.quit = true;
+        output = "quit\n";
+    }
+    else if (input[0] == "V2" && !s.v2) {
+        // answered in text, runSession switches the parser after it
+        s.v2 = true;
+        s.out.push("OK\n");
+        co_return;
+    }
+    else {
+        if(s.loggedIn){
+            cout << input[0]
+                 << " | Command not recognized. Try SEND/LIST/READ/DEL/QUIT" << endl;
+        }
+        else{
+            cout << "Try loggin in first, kekw" << endl;
+        }
+        output = "ERR\n";
+    }
+
+    if (s.v2 && !output.empty()) {
+        // the same verdict, framed for the request
+        output = v2Frame(output == "ERR\n" ? V2_ERR : V2_OK, 0, s.in.requestId(), {});
+    }
+    s.out.push(std::move(output));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+detachedTask runSession(connection *conn) {
+    session &s = conn->s;
+
+    ////////////////////////////////////////////////////////////////////////////
+    // SEND welcome message
+    s.out.push(WELCOME_MESSAGE);
+    co_await flushOutput(*conn);
+
+    vector<string_view> input;
+
+    while (!s.quit && !abortRequested) {
+        int rc = s.in.next(input);
+
+        /////////////////////////////////////////////////////////////////////////
+        // SEND the responses of all commands that were already buffered
+        // (pipelining), then RECEIVE until the next command is complete
+        if (rc == 0) {
+            co_await flushOutput(*conn);
+            if (s.closed) {
+                break;
+            }
+            while (!conn->receive()) {
+                co_await receiveReady{*conn};
+            }
+            continue;
+        }
+        if (rc < 0) {
+            printf("Command too long or malformed, closing\n");
+            s.out.push(s.v2 ? v2Frame(V2_ERR, 0, 0, {}) : "ERR\n");
+            break;
+        }
+
+        /////////////////////////////////////////////////////////////////////////
+        // HANDLE COMMAND
+        // input points into s.in, nothing is received until consume()
+        co_await handleCommand(*conn, input);
+        s.in.consume();
+        if (s.v2) {
+            s.in.useV2();
+        }
+
+        // don't let a client pile up responses it doesn't read
+        if (s.out.size() >= OUT_BATCH_SIZE) {
+            co_await flushOutput(*conn);
+        }
+    }
+    co_await flushOutput(*conn);
+
+    conn->done = true;
+    conn->top = nullptr;
+}
+
+void startSession(connection *conn) {
+    conn->top = runSession(conn).handle;
+    conn->top.resume();
+}
+
+void stopSession(connection *conn) {
+    if (!conn->done && conn->top) {
+        conn->top.destroy();
+    }
+    conn->top = nullptr;
+    conn->done = true;
+}
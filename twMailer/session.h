@@ -0,0 +1,92 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "lineparser.h"
+#include "outqueue.h"
+#include "protocol.h"
+#include "task.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define BUF 8192
+
+#define WELCOME_MESSAGE "Welcome to myserver!\r\n" V2_OFFER "\r\nPlease enter your commands...\r\n"
+
+extern int abortRequested;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// everything the server knows about one connected client
+struct session {
+    int socket = -1;
+    std::string clientIP;
+
+    bool loggedIn = false;
+    std::string username;
+    bool quit = false;
+    bool v2 = false;     // switched to protocol v2 (protocol.h)
+    bool closed = false; // peer went away or the socket broke
+
+    // received but unhandled bytes, unsent responses
+    lineParser in;
+    outQueue out;
+
+    // where blocking steps run, NULL = inline
+    scheduler *sched = NULL;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// how a session coroutine talks to its socket, every server mode has one
+// it is also where the session's blocking steps run (s.sched), inline unless
+// the mode offloads them
+class connection : public scheduler {
+public:
+    session s;
+    bool done = false; // session coroutine finished, connection can go
+    std::coroutine_handle<> top; // the session coroutine, see startSession()
+
+    virtual ~connection() {}
+
+    // move received bytes into s.in without waiting
+    // true if bytes arrived or s.closed is set, false = co_await receiveReady
+    virtual bool receive() = 0;
+    virtual void waitReceive(std::coroutine_handle<> h) = 0;
+
+    // hand s.out to the socket without waiting
+    // true once s.out is taken or s.closed is set, false = co_await sendReady
+    virtual bool send() = 0;
+    virtual void waitSend(std::coroutine_handle<> h) = 0;
+};
+
+struct receiveReady {
+    connection &conn;
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> h) { conn.waitReceive(h); }
+    void await_resume() {}
+};
+
+struct sendReady {
+    connection &conn;
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> h) { conn.waitSend(h); }
+    void await_resume() {}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// queues the response in conn.s.out, LIST streams, READ queues the file
+task<void> handleCommand(connection &conn, std::vector<std::string_view> &input);
+
+// the whole conversation with one client, sets conn->done at the end
+detachedTask runSession(connection *conn);
+// runs the session until it first suspends
+void startSession(connection *conn);
+// destroys a session that is still suspended (server shutdown)
+void stopSession(connection *conn);
+
+#endif
@@ -0,0 +1,149 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "auth.h"
+#include "groupcommit.h"
+#include "mailbox.h"
+#include "session.h"
+#include "test.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// myserver.cpp is not linked
+int abortRequested = 0;
+
+// "secret" is the password of every user, "down" stands for a backend that
+// can't be reached
+class mockAuth : public authenticator {
+public:
+    const char *name() override {
+        return "mock";
+    }
+
+    task<int> verify(scheduler *, const string &, const string &password) override {
+        if (password == "down") {
+            co_return AUTH_UNREACHABLE;
+        }
+        co_return password == "secret" ? AUTH_OK : AUTH_REJECTED;
+    }
+};
+
+// the client's side is a string, responses go through a socket pair so
+// file parts (READ) come out like they would on a real socket
+class scriptConnection : public connection {
+public:
+    string script;
+    string output;
+    int peer = -1;
+
+    bool receive() override {
+        if (script.empty()) {
+            s.closed = true;
+            return true;
+        }
+        CHECK(s.in.append(script.data(), script.size()));
+        script.clear();
+        return true;
+    }
+
+    void waitReceive(std::coroutine_handle<>) override {}
+
+    bool send() override {
+        while (!s.out.empty()) {
+            CHECK(s.out.sendTo(s.socket, MSG_NOSIGNAL) >= 0);
+            char buffer[BUF];
+            ssize_t size;
+            while ((size = recv(peer, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+                output.append(buffer, size);
+            }
+        }
+        return true;
+    }
+
+    void waitSend(std::coroutine_handle<>) override {}
+};
+
+// the responses to script, without the welcome message
+static string converse(const string &script) {
+    scriptConnection conn;
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    conn.s.socket = fds[0];
+    conn.peer = fds[1];
+    conn.s.clientIP = "127.0.0.1";
+    conn.script = script;
+
+    startSession(&conn);
+    CHECK(conn.done);
+
+    close(fds[0]);
+    close(fds[1]);
+    CHECK(conn.output.compare(0, sizeof(WELCOME_MESSAGE) - 1, WELCOME_MESSAGE) == 0);
+    return conn.output.substr(sizeof(WELCOME_MESSAGE) - 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main() {
+    // a spool of its own, MAILBOX_ROOT is relative to the working directory
+    char dir[] = "/tmp/sessiontestXXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    CHECK(mkdir((string(dir) + "/mail-spooler").c_str(), 0777) == 0);
+    CHECK(mkdir((string(dir) + "/bin").c_str(), 0777) == 0);
+    CHECK(chdir((string(dir) + "/bin").c_str()) == 0);
+
+    static mockAuth mock;
+    authBackend = &mock;
+    syncMode = SYNC_OFF;
+
+    const string login = "LOGIN\nbob\nsecret\n";
+
+    // SEND: the "." line ends the body and is not part of it
+    CHECK(converse(login + "SEND\nbob\nhi\nline 1\n.\n" + "READ\n0\n") == "OK\nOK\nOK 18\nbob\nbob\nhi\nline 1\n");
+    CHECK(converse(login + "SEND\nbob\ndots\n..\n. \n.\n" + "READ\n1\n") == "OK\nOK\nOK 19\nbob\nbob\ndots\n..\n. \n");
+    // an empty body is refused and the commands behind it still answered
+    CHECK(converse(login + "SEND\nbob\nempty\n.\nLIST\n") ==
+          "OK\nERR\nOK\n0: bob: hi\n1: bob: dots\nTotal message count: 2\n");
+
+    // user names of hex digits are mailboxes, at the old place as well
+    CHECK(mkdir(MAILBOX_ROOT "99", 0777) == 0);
+    FILE *legacy = fopen(MAILBOX_ROOT "99/bob_old.txt", "w");
+    CHECK(legacy != NULL && fputs("bob\n99\nold\nbody\n", legacy) >= 0 && fclose(legacy) == 0);
+    CHECK(mailboxMigrateAll() == 1);
+    CHECK(converse(login + "SEND\n12,99\nnew\nbody\n.\n") == "OK\nOK\n");
+    CHECK(converse("LOGIN\n99\nsecret\nLIST\n") == "OK\nOK\n0: bob: old\n1: bob: new\nTotal message count: 2\n");
+    CHECK(converse("LOGIN\n12\nsecret\nLIST\n") == "OK\nOK\n0: bob: new\nTotal message count: 1\n");
+    CHECK(converse(login + "LIST\n") == "OK\nOK\n0: bob: hi\n1: bob: dots\nTotal message count: 2\n");
+
+    // v2 after "V2": the body is stored byte for byte, READ returns it framed
+    string body("line\n.\n\0end", 12);
+    string record = "bob\nbob\nbinary\n" + body;
+    string v2Login = v2Frame(V2_LOGIN, 0, 1, {"bob", "secret"});
+    CHECK(converse("V2\n" + v2Login + v2Frame(V2_SEND, 0, 2, {"bob", "binary", body}) +
+                   v2Frame(V2_READ, 0, 3, {v2Number(2)})) ==
+          "OK\n" + v2Frame(V2_OK, 0, 1, {}) + v2Frame(V2_OK, 0, 2, {}) + v2Frame(V2_OK, 0, 3, {record}));
+    // subjects stay single lines, bodies aren't empty (like in text), READ
+    // takes a 4 byte number
+    CHECK(converse("V2\n" + v2Login + v2Frame(V2_SEND, 0, 2, {"bob", "a\nb", "x"}) +
+                   v2Frame(V2_READ, 0, 3, {"2"}) + v2Frame(0x42, 0, 4, {}) +
+                   v2Frame(V2_SEND, 0, 5, {"bob", "x", ""})) ==
+          "OK\n" + v2Frame(V2_OK, 0, 1, {}) + v2Frame(V2_ERR, 0, 2, {}) + v2Frame(V2_ERR, 0, 3, {}) +
+              v2Frame(V2_ERR, 0, 4, {}) + v2Frame(V2_ERR, 0, 5, {}));
+
+    // a failed LOGIN ends the previous one, also when the backend is down
+    CHECK(converse(login + "LOGIN\nvictim\ndown\nLIST\n") == "OK\nERR\nERR\n");
+    CHECK(converse(login + "LOGIN\nvictim\nwrong\nLIST\n") == "OK\nERR\nERR\n");
+    CHECK(converse(login + "LOGIN\nalice\nsecret\nLIST\n") == "OK\nOK\nOK\nTotal message count: 0\n");
+    // names SEND couldn't address don't get a mailbox
+    CHECK(converse("LOGIN\n.\nsecret\nLOGIN\n_00\nsecret\nLOGIN\na/b\nsecret\nLOGIN\nlongerthan8\nsecret\n") ==
+          "ERR\nERR\nERR\nERR\n");
+
+    CHECK(system(("rm -rf " + string(dir)).c_str()) == 0);
+    return testResult("sessiontest");
+}
@@ -0,0 +1,25 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+// SHA-256 (FIPS 180-4), small and dependency free
+// https://nvlpubs.nist.gov/nistpubs/FIPS/NIST.FIPS.180-4.pdf
+
+#include <stddef.h>
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define SHA256_SIZE 32
+
+struct sha256Context {
+    uint32_t state[8];
+    uint64_t length; // bytes hashed so far
+    unsigned char block[64];
+    size_t used;     // bytes in block
+};
+
+void sha256Init(sha256Context &ctx);
+void sha256Update(sha256Context &ctx, const void *data, size_t len);
+void sha256Final(sha256Context &ctx, unsigned char digest[SHA256_SIZE]);
+
+#endif
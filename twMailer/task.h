@@ -0,0 +1,207 @@
+#ifndef TASK_H
+#define TASK_H
+
+// C++20 coroutine plumbing for sessions
+// https://en.cppreference.com/w/cpp/language/coroutines
+// a session is a coroutine, it suspends whenever it would block and the loop
+// of the server mode (fork, epoll, io_uring) resumes it later, so a suspended
+// session costs one heap frame and no stack
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <poll.h>
+#include <utility>
+
+///////////////////////////////////////////////////////////////////////////////
+
+// resumes whoever co_awaited the finished task (symmetric transfer), unless
+// it finished while startTask() was still running it
+struct taskFinalAwaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+        if (h.promise().starting) {
+            return std::noop_coroutine(); // back into startTask(), the caller goes on from there
+        }
+        if (h.promise().continuation) {
+            return h.promise().continuation;
+        }
+        return std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+};
+
+struct taskPromiseBase {
+    std::coroutine_handle<> continuation;
+    bool starting = false; // inside startTask() and not suspended yet
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    taskFinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { std::terminate(); }
+};
+
+// runs a co_awaited task until it suspends or finishes
+// false: it finished, the caller continues without being resumed, so a session
+// that never suspends (fork mode, a long pipeline) doesn't grow the stack with
+// every command; symmetric transfer alone only stays flat when the compiler
+// makes it a tail call, which GCC doesn't do at -O
+template <typename Promise>
+bool startTask(std::coroutine_handle<Promise> h, std::coroutine_handle<> caller) {
+    h.promise().continuation = caller;
+    h.promise().starting = true;
+    h.resume();
+    if (h.done()) {
+        return false;
+    }
+    h.promise().starting = false;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// lazily started coroutine returning T, starts when co_awaited
+template <typename T>
+class task {
+public:
+    struct promise_type : taskPromiseBase {
+        T value;
+
+        task get_return_object() {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        void return_value(T v) { value = std::move(v); }
+    };
+
+    task(task &&other) noexcept : h(other.h) { other.h = nullptr; }
+    task(const task &) = delete;
+    ~task() {
+        if (h) {
+            h.destroy();
+        }
+    }
+
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<> caller) { return startTask(h, caller); }
+    T await_resume() { return std::move(h.promise().value); }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> handle) : h(handle) {}
+    std::coroutine_handle<promise_type> h;
+};
+
+template <>
+class task<void> {
+public:
+    struct promise_type : taskPromiseBase {
+        task get_return_object() {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        void return_void() {}
+    };
+
+    task(task &&other) noexcept : h(other.h) { other.h = nullptr; }
+    task(const task &) = delete;
+    ~task() {
+        if (h) {
+            h.destroy();
+        }
+    }
+
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<> caller) { return startTask(h, caller); }
+    void await_resume() {}
+
+private:
+    explicit task(std::coroutine_handle<promise_type> handle) : h(handle) {}
+    std::coroutine_handle<promise_type> h;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// top level coroutine nobody awaits, created suspended, frees itself when done
+struct detachedTask {
+    struct promise_type {
+        detachedTask get_return_object() {
+            return detachedTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// decides where the blocking steps of a session run (see diskpool.h)
+class scheduler {
+public:
+    virtual ~scheduler() {}
+
+    // false: blocking steps run inline on the session's thread
+    virtual bool offloads() { return false; }
+    // run work somewhere else and resume h from the loop once it is done
+    // op: what the work is (DISK_SEND, ...)
+    virtual void offload(int op, std::function<void()> work, std::coroutine_handle<> h) {
+        (void)op;
+        work();
+        h.resume();
+    }
+
+    // false: the session polls descriptors itself, blocking its thread
+    virtual bool watches() { return false; }
+    // resume h from the loop once fd is readable or timeoutMs passed,
+    // whichever comes first, the session finds out which
+    virtual void waitReadable(int fd, int timeoutMs, std::coroutine_handle<> h) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        poll(&pfd, 1, timeoutMs);
+        h.resume();
+    }
+};
+
+// co_await blockingStep(sched, DISK_..., [&] { ... }) for disk and directory work
+struct blockingStep {
+    scheduler *sched;
+    int op;
+    std::function<void()> work;
+
+    blockingStep(scheduler *s, int o, std::function<void()> w) : sched(s), op(o), work(std::move(w)) {}
+
+    bool await_ready() {
+        if (sched == NULL || !sched->offloads()) {
+            work();
+            return true;
+        }
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> h) { sched->offload(op, std::move(work), h); }
+    void await_resume() {}
+};
+
+// co_await readable(sched, fd, timeoutMs) for a descriptor somebody else
+// answers on (the directory), the loop watches it meanwhile
+struct readable {
+    scheduler *sched;
+    int fd;
+    int timeoutMs;
+
+    readable(scheduler *s, int f, int t) : sched(s), fd(f), timeoutMs(t) {}
+
+    bool await_ready() {
+        if (sched == NULL || !sched->watches()) {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            poll(&pfd, 1, timeoutMs);
+            return true;
+        }
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> h) { sched->waitReadable(fd, timeoutMs, h); }
+    void await_resume() {}
+};
+
+#endif
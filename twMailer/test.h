@@ -0,0 +1,31 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+///////////////////////////////////////////////////////////////////////////////
+
+// the checks of the *test.cpp programs, built and run by "make test"
+// no framework: a failed CHECK prints where it is and the test goes on,
+// main() ends with return testResult(), which is not 0 if anything failed
+
+static int testFailures = 0;
+
+#define CHECK(condition)                                                                   \
+    do {                                                                                   \
+        if (!(condition)) {                                                                \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            testFailures++;                                                                \
+        }                                                                                  \
+    } while (0)
+
+static inline int testResult(const char *name) {
+    if (testFailures > 0) {
+        fprintf(stderr, "%s: %d checks failed\n", name, testFailures);
+        return 1;
+    }
+    printf("%s: OK\n", name);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,236 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+// head/tail words are shared with the kernel
+#define LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static int sysSetup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sysEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int sysRegister(int fd, unsigned opcode, void *arg, unsigned nrArgs) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int uringInit(uring &ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring.fd = sysSetup(entries, &params);
+    if (ring.fd == -1) {
+        return -1;
+    }
+
+    ring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cqRingSize > ring.sqRingSize) {
+            ring.sqRingSize = ring.cqRingSize;
+        }
+        ring.cqRingSize = ring.sqRingSize;
+    }
+
+    ring.sqRing = mmap(NULL, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sqRing == MAP_FAILED) {
+        close(ring.fd);
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cqRing = ring.sqRing;
+    } else {
+        ring.cqRing = mmap(NULL, ring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cqRing == MAP_FAILED) {
+            munmap(ring.sqRing, ring.sqRingSize);
+            close(ring.fd);
+            return -1;
+        }
+    }
+
+    ring.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = (struct io_uring_sqe *)mmap(NULL, ring.sqesSize, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        if (ring.cqRing != ring.sqRing) {
+            munmap(ring.cqRing, ring.cqRingSize);
+        }
+        munmap(ring.sqRing, ring.sqRingSize);
+        close(ring.fd);
+        return -1;
+    }
+
+    char *sq = (char *)ring.sqRing;
+    ring.sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring.sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring.sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring.sqEntries = *(unsigned *)(sq + params.sq_off.ring_entries);
+
+    // sqe slot i is always array entry i
+    unsigned *array = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < ring.sqEntries; i++) {
+        array[i] = i;
+    }
+
+    char *cq = (char *)ring.cqRing;
+    ring.cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring.cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring.cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    ring.sqeTail = ring.sqeSubmitted = *ring.sqTail;
+    return 0;
+}
+
+void uringExit(uring &ring) {
+    if (ring.fd == -1) {
+        return;
+    }
+    munmap(ring.sqes, ring.sqesSize);
+    if (ring.cqRing != ring.sqRing) {
+        munmap(ring.cqRing, ring.cqRingSize);
+    }
+    munmap(ring.sqRing, ring.sqRingSize);
+    close(ring.fd);
+    ring.fd = -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct io_uring_sqe *uringGetSqe(uring &ring) {
+    unsigned head = LOAD_ACQUIRE(ring.sqHead);
+    if (ring.sqeTail - head >= ring.sqEntries) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring.sqes[ring.sqeTail & ring.sqMask];
+    ring.sqeTail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uringSubmitAndWait(uring &ring, unsigned waitNr) {
+    unsigned toSubmit = ring.sqeTail - ring.sqeSubmitted;
+    if (toSubmit > 0) {
+        STORE_RELEASE(ring.sqTail, ring.sqeTail);
+        ring.sqeSubmitted = ring.sqeTail;
+    }
+    if (toSubmit == 0 && waitNr == 0) {
+        return 0;
+    }
+
+    int rc;
+    do {
+        rc = sysEnter(ring.fd, toSubmit, waitNr, waitNr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    } while (rc == -1 && errno == EINTR && waitNr == 0);
+    return rc;
+}
+
+int uringSubmit(uring &ring) {
+    return uringSubmitAndWait(ring, 0);
+}
+
+struct io_uring_cqe *uringPeekCqe(uring &ring) {
+    unsigned head = *ring.cqHead;
+    if (head == LOAD_ACQUIRE(ring.cqTail)) {
+        return NULL;
+    }
+    return &ring.cqes[head & ring.cqMask];
+}
+
+void uringCqeSeen(uring &ring) {
+    STORE_RELEASE(ring.cqHead, *ring.cqHead + 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// don't use io_uring_buf_ring::bufs, the empty struct in front of it has size 1 in C++
+static struct io_uring_buf *ringEntry(uringBufRing &bufRing, unsigned index) {
+    return (struct io_uring_buf *)bufRing.ring + index;
+}
+
+int uringSetupBufRing(uring &ring, uringBufRing &bufRing, unsigned entries, unsigned bufSize, unsigned short bgid) {
+    bufRing.ringSize = entries * sizeof(struct io_uring_buf);
+    void *mem = mmap(NULL, bufRing.ringSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) {
+        return -1;
+    }
+    bufRing.ring = (struct io_uring_buf_ring *)mem;
+
+    bufRing.buffers = (char *)mmap(NULL, (size_t)entries * bufSize, PROT_READ | PROT_WRITE,
+                                   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (bufRing.buffers == MAP_FAILED) {
+        munmap(mem, bufRing.ringSize);
+        bufRing.ring = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)mem;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (sysRegister(ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        int err = errno;
+        munmap(bufRing.buffers, (size_t)entries * bufSize);
+        munmap(mem, bufRing.ringSize);
+        bufRing.ring = NULL;
+        errno = err;
+        return -1;
+    }
+
+    bufRing.entries = entries;
+    bufRing.bufSize = bufSize;
+    bufRing.bgid = bgid;
+
+    // hand all buffers to the kernel
+    for (unsigned i = 0; i < entries; i++) {
+        struct io_uring_buf *buf = ringEntry(bufRing, i);
+        buf->addr = (unsigned long)(bufRing.buffers + (size_t)i * bufSize);
+        buf->len = bufSize;
+        buf->bid = i;
+    }
+    STORE_RELEASE(&bufRing.ring->tail, (unsigned short)entries);
+    return 0;
+}
+
+void uringFreeBufRing(uring &ring, uringBufRing &bufRing) {
+    if (bufRing.ring == NULL) {
+        return;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = bufRing.bgid;
+    sysRegister(ring.fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+    munmap(bufRing.buffers, (size_t)bufRing.entries * bufRing.bufSize);
+    munmap(bufRing.ring, bufRing.ringSize);
+    bufRing.ring = NULL;
+}
+
+char *uringBuffer(uringBufRing &bufRing, unsigned short bid) {
+    return bufRing.buffers + (size_t)bid * bufRing.bufSize;
+}
+
+void uringRecycleBuffer(uringBufRing &bufRing, unsigned short bid) {
+    unsigned short tail = bufRing.ring->tail;
+    struct io_uring_buf *buf = ringEntry(bufRing, tail & (bufRing.entries - 1));
+    buf->addr = (unsigned long)uringBuffer(bufRing, bid);
+    buf->len = bufRing.bufSize;
+    buf->bid = bid;
+    STORE_RELEASE(&bufRing.ring->tail, (unsigned short)(tail + 1));
+}
@@ -0,0 +1,72 @@
+#ifndef URING_H
+#define URING_H
+
+// minimal io_uring wrapper on top of the raw system calls
+// https://man7.org/linux/man-pages/man7/io_uring.7.html
+// https://kernel.dk/io_uring.pdf
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct uring {
+    int fd = -1;
+
+    // submission queue, shared with the kernel
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    struct io_uring_sqe *sqes;
+    unsigned sqeTail = 0;      // entries handed out by uringGetSqe()
+    unsigned sqeSubmitted = 0; // entries already passed to the kernel
+
+    // completion queue, shared with the kernel
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+};
+
+// buffers the kernel picks from for IOSQE_BUFFER_SELECT receives
+struct uringBufRing {
+    struct io_uring_buf_ring *ring = NULL;
+    char *buffers = NULL;
+    unsigned entries = 0;
+    unsigned bufSize = 0;
+    unsigned short bgid = 0;
+    size_t ringSize = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// -1 and errno set on error
+int uringInit(uring &ring, unsigned entries);
+void uringExit(uring &ring);
+
+// NULL if the submission queue is full, call uringSubmit() first
+struct io_uring_sqe *uringGetSqe(uring &ring);
+
+// submits everything from uringGetSqe() and waits for waitNr completions
+int uringSubmitAndWait(uring &ring, unsigned waitNr);
+int uringSubmit(uring &ring);
+
+// next completion or NULL, release it with uringCqeSeen()
+struct io_uring_cqe *uringPeekCqe(uring &ring);
+void uringCqeSeen(uring &ring);
+
+// entries must be a power of two, -1 and errno set on error
+int uringSetupBufRing(uring &ring, uringBufRing &bufRing, unsigned entries, unsigned bufSize, unsigned short bgid);
+void uringFreeBufRing(uring &ring, uringBufRing &bufRing);
+char *uringBuffer(uringBufRing &bufRing, unsigned short bid);
+// give a buffer back to the kernel once its data has been consumed
+void uringRecycleBuffer(uringBufRing &bufRing, unsigned short bid);
+
+#endif
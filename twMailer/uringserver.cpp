@@ -0,0 +1,603 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <map>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "blacklist.h"
+#include "diskpool.h"
+#include "mailcache.h"
+#include "ratelimit.h"
+#include "server.h"
+#include "session.h"
+#include "uring.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// IO_URING MODE
+// one process, everything goes through one io_uring:
+// - one multishot accept for the listener
+// - one multishot recv per session, the kernel picks the receive buffer
+//   from a provided buffer ring, so idle sessions don't own a buffer
+//   (paused while a client sends more than its session has taken in)
+// - the responses a session produced in one round go out with one sendmsg,
+//   one per session in flight so they stay in order
+// - message files are spliced into a pipe and from there to the socket
+//   (io_uring has no sendfile), the body never enters user space
+// - the directory's socket a LOGIN waits on is polled once, linked to a
+//   timeout that cancels the poll when the directory takes too long
+// sessions are coroutines, a recv completion resumes the one waiting for input,
+// a poll on the disk pool's eventfd the ones whose blocking step finished
+// https://man7.org/linux/man-pages/man7/io_uring.7.html
+
+#define URING_ENTRIES 4096
+#define URING_BUFFERS 1024
+#define URING_BGID 0
+// queued + in flight response bytes before a session has to wait
+#define URING_SEND_WINDOW (64 * 1024)
+// file bytes per splice round trip, the default pipe size
+#define URING_SPLICE_CHUNK (64 * 1024)
+
+// operation in the low bits of user_data, the pointer in the rest
+#define URING_WATCH 0 // descriptor a session waits for, NULL: its link timeout
+#define URING_ACCEPT 1
+#define URING_RECV 2
+#define URING_SEND 3
+#define URING_SPLICE_IN 4  // file to pipe
+#define URING_SPLICE_OUT 5 // pipe to socket
+#define URING_NOTIFY 6     // mailbox cache's inotify descriptor readable
+#define URING_DISK 7       // disk pool's eventfd readable
+#define URING_TAG(ptr, op) ((__u64)(uintptr_t)(ptr) | (op))
+#define URING_OP(data) ((data) & 7)
+#define URING_PTR(data) ((void *)(uintptr_t)((data) & ~(__u64)7))
+
+class uringConnection;
+
+// connections with new responses or state changes in this round
+static vector<uringConnection *> touched;
+
+static void uringArmWatch(uringConnection *conn, int fd);
+
+class uringConnection : public connection {
+public:
+    std::coroutine_handle<> reader;
+    std::coroutine_handle<> writer;
+
+    string received; // filled from recv completions
+    bool peerClosed = false;
+
+    bool recvArmed = false;
+    bool recvPaused = false; // received is full, no recv until the session drained it
+    bool closing = false;
+    bool isTouched = false;
+    bool sendInFlight = false;
+    outQueue pending; // responses not sent yet, the front may be in flight
+
+    int pipeFds[2] = {-1, -1}; // for splicing files, created on first use
+    size_t pipeBytes = 0;      // spliced in but not out yet
+
+    std::coroutine_handle<> watcher; // waitReadable(), resumed by the poll completion
+    struct __kernel_timespec watchTimeout; // read by the kernel when the link is submitted
+
+    ~uringConnection() {
+        if (pipeFds[0] != -1) {
+            close(pipeFds[0]);
+            close(pipeFds[1]);
+        }
+    }
+
+    void touch() {
+        if (!isTouched) {
+            isTouched = true;
+            touched.push_back(this);
+        }
+    }
+
+    bool receive() override {
+        if (!received.empty()) {
+            // whatever fits, the rest waits until the session consumed some
+            size_t taken = 0;
+            while (taken < received.size()) {
+                size_t available;
+                char *dest = s.in.reserve(received.size() - taken, &available);
+                if (dest == NULL) {
+                    break;
+                }
+                size_t n = min(available, received.size() - taken);
+                memcpy(dest, received.data() + taken, n);
+                s.in.commit(n);
+                taken += n;
+            }
+            received.erase(0, taken);
+            return true;
+        }
+        if (peerClosed) {
+            s.closed = true;
+            return true;
+        }
+        return false;
+    }
+
+    void waitReceive(std::coroutine_handle<> h) override {
+        reader = h;
+    }
+
+    // queued here, submitted at the end of the round
+    bool send() override {
+        if (s.closed || closing) {
+            s.out.clear();
+            return true;
+        }
+        if (s.out.empty()) {
+            return true;
+        }
+        if (pending.size() >= URING_SEND_WINDOW) {
+            return false;
+        }
+        pending.append(s.out);
+        touch();
+        return true;
+    }
+
+    void waitSend(std::coroutine_handle<> h) override {
+        writer = h;
+    }
+
+    bool offloads() override {
+        return diskPoolRunning();
+    }
+
+    // whatever the session queued after the step goes out with this round
+    void offload(int op, std::function<void()> work, std::coroutine_handle<> h) override {
+        diskSubmit(op, std::move(work), [this, h] {
+            h.resume();
+            touch();
+        });
+    }
+
+    bool watches() override {
+        return true;
+    }
+
+    void waitReadable(int fd, int timeoutMs, std::coroutine_handle<> h) override {
+        watcher = h;
+        watchTimeout.tv_sec = timeoutMs / 1000;
+        watchTimeout.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+        uringArmWatch(this, fd);
+    }
+};
+
+// the sendmsg in flight, it points into conn->pending
+struct uringSend {
+    uringConnection *conn;
+    struct iovec iov[OUT_MAX_IOV];
+    struct msghdr msg;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+static struct io_uring_sqe *uringSqe(uring &ring) {
+    struct io_uring_sqe *sqe;
+    while ((sqe = uringGetSqe(ring)) == NULL) {
+        uringSubmit(ring);
+    }
+    return sqe;
+}
+
+static void uringArmAccept(uring &ring) {
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = create_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_TAG(NULL, URING_ACCEPT);
+}
+
+static void uringArmRecv(uring &ring, uringConnection *conn) {
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->s.socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_TAG(conn, URING_RECV);
+    conn->recvArmed = true;
+}
+
+// stops the multishot recv of a client that sends faster than its session
+// takes commands, it ends with -ECANCELED
+static void uringPauseRecv(uring &ring, uringConnection *conn) {
+    conn->recvPaused = true;
+    if (conn->recvArmed) {
+        struct io_uring_sqe *sqe = uringSqe(ring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_TAG(conn, URING_RECV);
+        sqe->user_data = URING_TAG(NULL, URING_WATCH);
+    }
+}
+
+static void uringResumeRecv(uring &ring, uringConnection *conn) {
+    if (conn->recvPaused && conn->received.size() < MAX_COMMAND_SIZE) {
+        conn->recvPaused = false;
+        if (!conn->recvArmed && !conn->closing) {
+            uringArmRecv(ring, conn);
+        }
+    }
+}
+
+// multishot poll, stays armed as long as CQEs carry IORING_CQE_F_MORE
+static void uringArmPoll(uring &ring, int fd, int op) {
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = URING_TAG(NULL, op);
+}
+
+// the ring of the loop, for the sessions' waitReadable()
+static uring *loopRing = NULL;
+
+// one-shot poll, cancelled by the linked timeout (-ECANCELED) if the
+// descriptor stays quiet; both go out in the same submission
+static void uringArmWatch(uringConnection *conn, int fd) {
+    uring &ring = *loopRing;
+    if (ring.sqEntries - (ring.sqeTail - *ring.sqHead) < 2) {
+        uringSubmit(ring);
+    }
+
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = URING_TAG(conn, URING_WATCH);
+
+    sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (unsigned long)&conn->watchTimeout;
+    sqe->len = 1;
+    sqe->user_data = URING_TAG(NULL, URING_WATCH);
+}
+
+// the armed recv completes once the socket is shut down, the connection is freed after that
+static void uringStartClose(uringConnection *conn) {
+    if (!conn->closing) {
+        conn->closing = true;
+        shutdown(conn->s.socket, SHUT_RDWR);
+    }
+}
+
+static void uringPrepSplice(struct io_uring_sqe *sqe, int fdIn, __u64 offIn, int fdOut, unsigned len) {
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = fdOut;
+    sqe->off = (__u64)-1;
+    sqe->splice_fd_in = fdIn;
+    sqe->splice_off_in = offIn;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE;
+}
+
+// file part at the front: splice file -> pipe -> socket as one linked pair
+// a short first splice cancels the second, what is left in the pipe goes
+// out on its own next time
+static void uringSubmitSplice(uring &ring, uringConnection *conn) {
+    if (conn->pipeFds[0] == -1 && pipe2(conn->pipeFds, O_CLOEXEC) == -1) {
+        perror("pipe");
+        conn->s.closed = true;
+        conn->pending.clear();
+        uringStartClose(conn);
+        return;
+    }
+
+    if (conn->pipeBytes > 0) {
+        struct io_uring_sqe *sqe = uringSqe(ring);
+        uringPrepSplice(sqe, conn->pipeFds[0], (__u64)-1, conn->s.socket, conn->pipeBytes);
+        sqe->user_data = URING_TAG(conn, URING_SPLICE_OUT);
+        conn->sendInFlight = true;
+        return;
+    }
+
+    // a link must not be split over two submissions
+    if (ring.sqEntries - (ring.sqeTail - *ring.sqHead) < 2) {
+        uringSubmit(ring);
+    }
+
+    const outPart *file = conn->pending.frontFile();
+    unsigned len = min(file->length, (size_t)URING_SPLICE_CHUNK);
+
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    uringPrepSplice(sqe, file->fd, file->offset, conn->pipeFds[1], len);
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = URING_TAG(conn, URING_SPLICE_IN);
+
+    sqe = uringSqe(ring);
+    uringPrepSplice(sqe, conn->pipeFds[0], (__u64)-1, conn->s.socket, len);
+    sqe->user_data = URING_TAG(conn, URING_SPLICE_OUT);
+    conn->sendInFlight = true;
+}
+
+// one send per session in flight at a time, otherwise two could interleave
+static void uringSubmitSends(uring &ring, uringConnection *conn) {
+    if (conn->sendInFlight || conn->closing) {
+        return;
+    }
+    // bytes still in the pipe come before anything queued after them
+    if (conn->pipeBytes > 0 || conn->pending.frontFile() != NULL) {
+        uringSubmitSplice(ring, conn);
+        return;
+    }
+    if (conn->pending.empty()) {
+        return;
+    }
+
+    uringSend *send = new uringSend;
+    send->conn = conn;
+    memset(&send->msg, 0, sizeof(send->msg));
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen = conn->pending.gather(send->iov, OUT_MAX_IOV);
+
+    // MSG_WAITALL: the kernel finishes short sends itself
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->s.socket;
+    sqe->addr = (unsigned long)&send->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = URING_TAG(send, URING_SEND);
+    conn->sendInFlight = true;
+}
+
+static void resumeWaiters(uringConnection *conn) {
+    if (conn->reader && (!conn->received.empty() || conn->peerClosed)) {
+        std::coroutine_handle<> h = conn->reader;
+        conn->reader = nullptr;
+        h.resume();
+    }
+    if (!conn->done && conn->writer && (conn->pending.size() < URING_SEND_WINDOW || conn->closing)) {
+        std::coroutine_handle<> h = conn->writer;
+        conn->writer = nullptr;
+        h.resume();
+    }
+}
+
+// returns true if the connection was freed
+static bool uringFinishConnection(uringConnection *conn, map<int, uringConnection *> &connections) {
+    if (!conn->closing && conn->done && !conn->sendInFlight && conn->pending.empty() && conn->pipeBytes == 0) {
+        uringStartClose(conn);
+    }
+    if (!conn->done || !conn->closing || conn->recvArmed || conn->sendInFlight) {
+        return false;
+    }
+    connections.erase(conn->s.socket);
+    if (close(conn->s.socket) == -1) {
+        perror("close session socket");
+    }
+    delete conn;
+    return true;
+}
+
+void uringLoop() {
+    uring ring;
+    uringBufRing bufRing;
+    map<int, uringConnection *> connections;
+
+    if (uringInit(ring, URING_ENTRIES) == -1) {
+        perror("io_uring_setup");
+        return;
+    }
+
+    if (uringSetupBufRing(ring, bufRing, URING_BUFFERS, BUF, URING_BGID) == -1) {
+        perror("io_uring provided buffer ring");
+        uringExit(ring);
+        return;
+    }
+
+    loopRing = &ring;
+    uringArmAccept(ring);
+
+    // mailbox changes of other processes reach the cache through the loop
+    int notifyFd = mailCacheInit();
+    if (notifyFd != -1) {
+        uringArmPoll(ring, notifyFd, URING_NOTIFY);
+    }
+
+    // blocking steps of the sessions come back through the ring as well
+    int diskFd = diskPoolStart();
+    if (diskFd != -1) {
+        uringArmPoll(ring, diskFd, URING_DISK);
+    }
+
+    printf("Waiting for connections (io_uring)...\n");
+
+    while (!abortRequested) {
+        if (uringSubmitAndWait(ring, 1) == -1) {
+            if (errno != EINTR) {
+                perror("io_uring_enter");
+                break;
+            }
+            continue;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uringPeekCqe(ring)) != NULL) {
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            __u64 data = cqe->user_data;
+            uringCqeSeen(ring);
+
+            if (URING_OP(data) == URING_WATCH) {
+                // readable, or cancelled by its timeout: the session looks itself
+                uringConnection *conn = (uringConnection *)URING_PTR(data);
+                if (conn != NULL && conn->watcher) {
+                    std::coroutine_handle<> h = conn->watcher;
+                    conn->watcher = nullptr;
+                    h.resume();
+                    conn->touch();
+                }
+            }
+
+            else if (URING_OP(data) == URING_ACCEPT) {
+                struct sockaddr_in cliaddress;
+                socklen_t addrlen = sizeof(cliaddress);
+                bool named = res >= 0 && getpeername(res, (struct sockaddr *)&cliaddress, &addrlen) == 0;
+                if (named && (blacklistRange((struct sockaddr *)&cliaddress) ||
+                              !rateAllowAddress((struct sockaddr *)&cliaddress))) {
+                    // banned networks and addresses over their rate never get a
+                    // session (blacklist.h, ratelimit.h)
+                    close(res);
+                } else if (res >= 0) {
+                    uringConnection *conn = new uringConnection;
+                    conn->s.socket = res;
+                    conn->s.sched = conn;
+                    if (named) {
+                        conn->s.clientIP = inet_ntoa(cliaddress.sin_addr);
+                    }
+                    connections[res] = conn;
+                    uringArmRecv(ring, conn);
+                    conn->touch();
+                    startSession(conn);
+                } else if (!abortRequested) {
+                    // EMFILE/ENFILE: out of descriptors, the rest stays in the backlog
+                    errno = -res;
+                    perror("accept error");
+                }
+                if (!(flags & IORING_CQE_F_MORE) && !abortRequested) {
+                    uringArmAccept(ring);
+                }
+            }
+
+            else if (URING_OP(data) == URING_NOTIFY) {
+                mailCacheEvents();
+                if (!(flags & IORING_CQE_F_MORE) && !abortRequested) {
+                    uringArmPoll(ring, notifyFd, URING_NOTIFY);
+                }
+            }
+
+            else if (URING_OP(data) == URING_DISK) {
+                diskComplete();
+                if (!(flags & IORING_CQE_F_MORE) && !abortRequested) {
+                    uringArmPoll(ring, diskFd, URING_DISK);
+                }
+            }
+
+            else if (URING_OP(data) == URING_RECV) {
+                uringConnection *conn = (uringConnection *)URING_PTR(data);
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    conn->recvArmed = false;
+                }
+
+                if (res > 0) {
+                    unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                    if (!conn->closing) {
+                        // as much as the parser holds, like epoll mode
+                        conn->received.append(uringBuffer(bufRing, bid), res);
+                        if (conn->received.size() >= MAX_COMMAND_SIZE) {
+                            if (!conn->recvPaused) {
+                                uringPauseRecv(ring, conn);
+                            }
+                        } else if (!conn->recvArmed && !conn->recvPaused) {
+                            uringArmRecv(ring, conn);
+                        }
+                    }
+                    uringRecycleBuffer(bufRing, bid);
+                } else if ((res == -ENOBUFS || res == -ECANCELED) && !conn->closing) {
+                    // every buffer is in use, try again once some are recycled;
+                    // cancelled by uringPauseRecv, armed again by uringResumeRecv
+                    if (!conn->recvArmed && !conn->recvPaused) {
+                        uringArmRecv(ring, conn);
+                    }
+                } else {
+                    if (res == 0) {
+                        printf("Client closed remote socket\n"); // ignore error
+                    }
+                    conn->peerClosed = true;
+                    uringStartClose(conn);
+                }
+                conn->touch();
+            }
+
+            else if (URING_OP(data) == URING_SEND) {
+                uringSend *send = (uringSend *)URING_PTR(data);
+                uringConnection *conn = send->conn;
+                conn->sendInFlight = false;
+                if (res < 0) {
+                    errno = -res;
+                    perror("send failed");
+                    conn->s.closed = true;
+                    conn->pending.clear();
+                    uringStartClose(conn);
+                } else {
+                    conn->pending.advance(res);
+                }
+                delete send;
+                conn->touch();
+            }
+
+            else if (URING_OP(data) == URING_SPLICE_IN) {
+                uringConnection *conn = (uringConnection *)URING_PTR(data);
+                if (res > 0) {
+                    conn->pending.advance(res);
+                    conn->pipeBytes += res;
+                } else if (!conn->closing) {
+                    // 0: the file got shorter than announced
+                    errno = res < 0 ? -res : EIO;
+                    perror("splice failed");
+                    conn->s.closed = true;
+                    conn->pending.clear();
+                    uringStartClose(conn);
+                }
+                conn->touch();
+            }
+
+            else if (URING_OP(data) == URING_SPLICE_OUT) {
+                uringConnection *conn = (uringConnection *)URING_PTR(data);
+                conn->sendInFlight = false;
+                if (res > 0) {
+                    conn->pipeBytes -= res;
+                } else if (res != -ECANCELED && !conn->closing) {
+                    // -ECANCELED after a short splice in, the pipe is sent next round
+                    errno = res < 0 ? -res : EIO;
+                    perror("send failed");
+                    conn->s.closed = true;
+                    conn->pending.clear();
+                    uringStartClose(conn);
+                }
+                conn->touch();
+            }
+        }
+
+        // resuming a session can touch more connections, so go by index
+        for (size_t i = 0; i < touched.size(); i++) {
+            uringConnection *conn = touched[i];
+            resumeWaiters(conn);
+            uringResumeRecv(ring, conn);
+            uringSubmitSends(ring, conn);
+            conn->isTouched = false;
+            uringFinishConnection(conn, connections);
+        }
+        touched.clear();
+    }
+
+    // closing the ring cancels whatever is still in flight, no thread may
+    // still work for a session that is destroyed
+    uringExit(ring);
+    loopRing = NULL;
+    diskPoolStop();
+    mailCacheClose();
+    uringFreeBufRing(ring, bufRing);
+    for (map<int, uringConnection *>::iterator it = connections.begin(); it != connections.end(); ++it) {
+        stopSession(it->second);
+        close(it->first);
+        delete it->second;
+    }
+    touched.clear();
+}
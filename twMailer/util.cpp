@@ -0,0 +1,66 @@
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "util.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+int64_t nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t stringHash(string_view text) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < text.size(); i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint32_t ipKey(const string &ip) {
+    struct in_addr in;
+    if (inet_pton(AF_INET, ip.c_str(), &in) != 1) {
+        return 0;
+    }
+    return ntohl(in.s_addr);
+}
+
+uint32_t userKey(const string &user) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < user.size(); i++) {
+        hash = (hash ^ (unsigned char)user[i]) * 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash == 0 ? 1 : hash;
+}
+
+uint32_t firstSlot(uint32_t key, uint32_t slots) {
+    return (key * 2654435761u) & (slots - 1);
+}
+
+bool validUser(string_view name) {
+    if (name.empty() || name.size() > USER_NAME_MAX) {
+        return false;
+    }
+    for (char c : name) {
+        if (!islower(c) && !isdigit(c)) {
+            return false;
+        }
+    }
+    return true;
+}
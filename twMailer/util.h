@@ -0,0 +1,35 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+
+///////////////////////////////////////////////////////////////////////////////
+
+// small helpers several modules share
+
+#define USER_NAME_MAX 8
+
+// CLOCK_MONOTONIC, the same in every process of the server
+int64_t nowMs();
+int64_t nowUs();
+
+// FNV-1a, 64 bit (mailbox shards and subjects, credential database slots;
+// both are on disk, the function must not change)
+uint64_t stringHash(std::string_view text);
+
+// keys of the shared memory tables (attempts.h, ratelimit.h), 0 = free slot
+// host byte order, 0 for anything but a dotted IPv4 address
+uint32_t ipKey(const std::string &ip);
+// 32 bit FNV-1a of the user name mixed like the MurmurHash3 finalizer, never 0
+uint32_t userKey(const std::string &user);
+// where the linear probe for key starts (Knuth's multiplicative hash), also
+// for the ban table (blacklist.h); slots is a power of two
+uint32_t firstSlot(uint32_t key, uint32_t slots);
+
+// up to USER_NAME_MAX of a-z, 0-9: what SEND can address, LOGIN and the
+// credential database accept, and what is safe as a mailbox directory
+bool validUser(std::string_view name);
+
+#endif